@@ -0,0 +1,216 @@
+#include "sps_auth.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include <butil/base64.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+#include <butil/strings/string_number_conversions.h>
+#include <butil/third_party/rapidjson/document.h>
+#include <bvar/bvar.h>
+
+
+namespace sps {
+
+static const size_t kCacheShards = 16;
+
+static bvar::LatencyRecorder g_verify_latency("sps_auth_verify");
+static bvar::Adder<int64_t> g_cache_hit("sps_auth_cache_hit");
+static bvar::Adder<int64_t> g_cache_miss("sps_auth_cache_miss");
+static bvar::Window<bvar::Adder<int64_t> > g_cache_hit_window(&g_cache_hit, 60);
+static bvar::Window<bvar::Adder<int64_t> > g_cache_miss_window(&g_cache_miss, 60);
+
+static double get_cache_hit_ratio(void*) {
+    int64_t hit = g_cache_hit_window.get_value();
+    int64_t total = hit + g_cache_miss_window.get_value();
+    return total == 0 ? 0 : (double)hit / total;
+}
+static bvar::PassiveStatus<double> g_cache_hit_ratio(
+        "sps_auth_cache_hit_ratio", get_cache_hit_ratio, NULL);
+
+// base64url without padding, as used by JWT.
+static bool base64url_decode(const std::string& in, std::string* out) {
+    std::string b64(in);
+    for (char& c : b64) {
+        if (c == '-') c = '+';
+        else if (c == '_') c = '/';
+    }
+    while (b64.size() % 4) {
+        b64.push_back('=');
+    }
+    return butil::Base64Decode(b64, out);
+}
+
+static std::string base64url_encode(const std::string& in) {
+    std::string b64;
+    butil::Base64Encode(in, &b64);
+    while (!b64.empty() && b64.back() == '=') {
+        b64.pop_back();
+    }
+    for (char& c : b64) {
+        if (c == '+') c = '-';
+        else if (c == '/') c = '_';
+    }
+    return b64;
+}
+
+static std::string hmac_sha256(const std::string& key, const char* data, size_t len) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+    HMAC(EVP_sha256(), key.data(), key.size(),
+         reinterpret_cast<const unsigned char*>(data), len, md, &md_len);
+    return std::string(reinterpret_cast<const char*>(md), md_len);
+}
+
+TokenVerifier::TokenVerifier(const std::string& secret, const std::string& uid_claim,
+                             size_t cache_capacity)
+    : secret_(secret)
+    , uid_claim_(uid_claim) {
+    for (size_t i = 0; i < kCacheShards; ++i) {
+        shards_.emplace_back(new Cache(cache_capacity / kCacheShards + 1));
+    }
+}
+
+TokenVerifier::~TokenVerifier() {
+}
+
+bool TokenVerifier::Verify(const std::string& token, int64_t uid, std::string* reason) {
+    unsigned char md[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(token.data()), token.size(), md);
+    std::string digest(reinterpret_cast<const char*>(md), sizeof(md));
+
+    Claims claims;
+    Cache& cache = shard(digest);
+    if (cache.Get(digest, &claims)) {
+        g_cache_hit << 1;
+    } else {
+        g_cache_miss << 1;
+        int64_t start_us = butil::cpuwide_time_us();
+        bool ok = VerifySignature(token, &claims, reason);
+        g_verify_latency << butil::cpuwide_time_us() - start_us;
+        if (!ok) {
+            return false;
+        }
+        cache.Put(digest, claims);
+    }
+
+    if (claims.expire_s != 0 && claims.expire_s <= butil::gettimeofday_s()) {
+        *reason = "token expired";
+        return false;
+    }
+    if (claims.uid != uid) {
+        *reason = "token is not issued to this user";
+        return false;
+    }
+    return true;
+}
+
+bool TokenVerifier::VerifySignature(const std::string& token, Claims* claims,
+                                    std::string* reason) const {
+    size_t dot1 = token.find('.');
+    size_t dot2 = (dot1 == std::string::npos) ? dot1 : token.find('.', dot1 + 1);
+    if (dot2 == std::string::npos) {
+        *reason = "malformed token";
+        return false;
+    }
+
+    std::string header;
+    std::string payload;
+    std::string signature;
+    if (!base64url_decode(token.substr(0, dot1), &header)
+            || !base64url_decode(token.substr(dot1 + 1, dot2 - dot1 - 1), &payload)
+            || !base64url_decode(token.substr(dot2 + 1), &signature)) {
+        *reason = "malformed token encoding";
+        return false;
+    }
+
+    BUTIL_RAPIDJSON_NAMESPACE::Document doc;
+    doc.Parse(header.c_str());
+    if (doc.HasParseError() || !doc.IsObject()
+            || !doc.HasMember("alg") || !doc["alg"].IsString()
+            || strcmp(doc["alg"].GetString(), "HS256") != 0) {
+        *reason = "token algorithm is not HS256";
+        return false;
+    }
+
+    std::string expected = hmac_sha256(secret_, token.data(), dot2);
+    if (expected.size() != signature.size()
+            || CRYPTO_memcmp(expected.data(), signature.data(), expected.size()) != 0) {
+        *reason = "bad token signature";
+        return false;
+    }
+
+    doc.Parse(payload.c_str());
+    if (doc.HasParseError() || !doc.IsObject()
+            || !doc.HasMember(uid_claim_.c_str())) {
+        *reason = "token has no " + uid_claim_ + " claim";
+        return false;
+    }
+    // the uid claim could be either a number or a string of number.
+    const BUTIL_RAPIDJSON_NAMESPACE::Value& v = doc[uid_claim_.c_str()];
+    if (v.IsInt64()) {
+        claims->uid = v.GetInt64();
+    } else if (!v.IsString() || !butil::StringToInt64(v.GetString(), &claims->uid)) {
+        *reason = "token " + uid_claim_ + " claim is not a number";
+        return false;
+    }
+    claims->expire_s = 0;
+    if (doc.HasMember("exp")) {
+        if (!doc["exp"].IsInt64()) {
+            *reason = "token exp claim is not a number";
+            return false;
+        }
+        claims->expire_s = doc["exp"].GetInt64();
+    }
+    return true;
+}
+
+std::string TokenVerifier::Sign(const std::string& secret, const std::string& payload) {
+    std::string token = base64url_encode("{\"alg\":\"HS256\",\"typ\":\"JWT\"}");
+    token += '.';
+    token += base64url_encode(payload);
+    std::string signature = hmac_sha256(secret, token.data(), token.size());
+    token += '.';
+    token += base64url_encode(signature);
+    return token;
+}
+
+TokenVerifier::Cache& TokenVerifier::shard(const std::string& digest) {
+    return *shards_[static_cast<unsigned char>(digest[0]) % shards_.size()];
+}
+
+TokenVerifier::Cache::Cache(size_t capacity)
+    : capacity_(capacity) {
+    CHECK_EQ(0, index_.init(capacity_ * 2, 70));
+}
+
+bool TokenVerifier::Cache::Get(const std::string& digest, Claims* claims) {
+    BAIDU_SCOPED_LOCK(mutex_);
+    List::iterator* pit = index_.seek(digest);
+    if (pit == NULL) {
+        return false;
+    }
+    lru_.splice(lru_.begin(), lru_, *pit);
+    *claims = (*pit)->second;
+    return true;
+}
+
+void TokenVerifier::Cache::Put(const std::string& digest, const Claims& claims) {
+    BAIDU_SCOPED_LOCK(mutex_);
+    List::iterator* pit = index_.seek(digest);
+    if (pit) {
+        (*pit)->second = claims;
+        lru_.splice(lru_.begin(), lru_, *pit);
+        return;
+    }
+    lru_.emplace_front(digest, claims);
+    index_[digest] = lru_.begin();
+    if (lru_.size() > capacity_) {
+        index_.erase(lru_.back().first);
+        lru_.pop_back();
+    }
+}
+
+}  // namespace sps
@@ -0,0 +1,63 @@
+#ifndef SPS_AUTH_H_
+#define SPS_AUTH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+#include <bthread/mutex.h>
+#include <butil/containers/flat_map.h>
+
+
+namespace sps {
+
+// Verifies HS256 JSON Web Tokens. Tokens verified once are remembered by
+// the SHA-256 digest in a sharded LRU cache, so that reconnect storms do
+// not pay for signature checks again.
+class TokenVerifier {
+public:
+    TokenVerifier(const std::string& secret, const std::string& uid_claim,
+                  size_t cache_capacity);
+    ~TokenVerifier();
+
+    // Returns true if `token' is well signed, not expired, and its uid claim
+    // equals `uid'. Otherwise fills `reason'.
+    bool Verify(const std::string& token, int64_t uid, std::string* reason);
+
+    // Makes a HS256 token of `payload', for testing and tools.
+    static std::string Sign(const std::string& secret, const std::string& payload);
+
+private:
+    struct Claims {
+        int64_t uid;
+        int64_t expire_s;  // 0 if never expire
+    };
+
+    class Cache {
+    public:
+        explicit Cache(size_t capacity);
+        bool Get(const std::string& digest, Claims* claims);
+        void Put(const std::string& digest, const Claims& claims);
+
+    private:
+        typedef std::list< std::pair<std::string, Claims> > List;
+
+        const size_t capacity_;
+        bthread::Mutex mutex_;
+        List lru_;  // most recently used at front
+        butil::FlatMap<std::string, List::iterator> index_;
+    };
+
+    bool VerifySignature(const std::string& token, Claims* claims, std::string* reason) const;
+    Cache& shard(const std::string& digest);
+
+    const std::string secret_;
+    const std::string uid_claim_;
+    std::vector< std::unique_ptr<Cache> > shards_;
+};
+
+}  // namespace sps
+
+#endif  // SPS_AUTH_H_
@@ -0,0 +1,174 @@
+#include <unistd.h>
+#include <gflags/gflags.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+#include <bthread/bthread.h>
+#include <bvar/bvar.h>
+#include <brpc/channel.h>
+#include <brpc/stream.h>
+
+#include "sps.pb.h"
+
+
+DEFINE_string(server, "127.0.0.1:8080", "IP Address of sps");
+DEFINE_string(mode, "stream", "How to publish: http, baidu_std or stream");
+DEFINE_string(room, "hall", "The room that events are published to");
+DEFINE_int32(payload_size, 64, "Bytes of each event");
+DEFINE_int32(thread_num, 8, "Number of publishers");
+DEFINE_int32(duration_s, 10, "Seconds the benchmark lasts");
+DEFINE_int32(timeout_ms, 1000, "RPC timeout in milliseconds");
+DEFINE_int32(stream_max_buf_size, 2 * 1024 * 1024, "Max bytes of a stream "
+             "not yet consumed by sps before the publisher waits");
+
+bvar::LatencyRecorder g_latency_recorder("sps_benchmark_publish");
+bvar::Adder<int64_t> g_error_count("sps_benchmark_publish_error");
+
+static volatile bool g_stop = false;
+
+struct Publisher {
+    brpc::Channel http_channel;
+    brpc::Channel std_channel;
+    std::string payload;
+};
+
+static void* publish_by_http(Publisher* p) {
+    std::string url = "/PushService/notify_to_room?r=" + FLAGS_room;
+    while (!g_stop) {
+        brpc::Controller cntl;
+        cntl.http_request().uri() = url;
+        cntl.http_request().set_method(brpc::HTTP_METHOD_POST);
+        cntl.request_attachment().append(p->payload);
+        p->http_channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+        if (cntl.Failed()) {
+            g_error_count << 1;
+            LOG_EVERY_SECOND(WARNING) << cntl.ErrorText();
+            bthread_usleep(50000);
+            continue;
+        }
+        g_latency_recorder << cntl.latency_us();
+    }
+    return NULL;
+}
+
+static void* publish_by_baidu_std(Publisher* p) {
+    sps::PublishService_Stub stub(&p->std_channel);
+    sps::PublishRequest request;
+    request.add_room_ids(FLAGS_room);
+    request.set_data(p->payload);
+    while (!g_stop) {
+        brpc::Controller cntl;
+        sps::PublishResponse response;
+        stub.publish(&cntl, &request, &response, NULL);
+        if (cntl.Failed()) {
+            g_error_count << 1;
+            LOG_EVERY_SECOND(WARNING) << cntl.ErrorText();
+            bthread_usleep(50000);
+            continue;
+        }
+        g_latency_recorder << cntl.latency_us();
+    }
+    return NULL;
+}
+
+static void* publish_by_stream(Publisher* p) {
+    brpc::Controller cntl;
+    brpc::StreamId stream;
+    brpc::StreamOptions stream_options;
+    stream_options.max_buf_size = FLAGS_stream_max_buf_size;
+    if (brpc::StreamCreate(&stream, cntl, &stream_options) != 0) {
+        LOG(ERROR) << "Fail to create stream";
+        return NULL;
+    }
+    sps::PublishService_Stub stub(&p->std_channel);
+    sps::PublishStreamRequest request;
+    sps::PublishStreamResponse response;
+    stub.open_stream(&cntl, &request, &response, NULL);
+    if (cntl.Failed()) {
+        LOG(ERROR) << "Fail to open stream: " << cntl.ErrorText();
+        return NULL;
+    }
+
+    sps::PublishRequest event;
+    event.add_room_ids(FLAGS_room);
+    event.set_data(p->payload);
+    butil::IOBuf message;
+    {
+        butil::IOBufAsZeroCopyOutputStream wrapper(&message);
+        event.SerializeToZeroCopyStream(&wrapper);
+    }
+    while (!g_stop) {
+        int64_t start_us = butil::cpuwide_time_us();
+        int rc = brpc::StreamWrite(stream, message);
+        if (rc == EAGAIN) {
+            // flow control: sps has not consumed enough yet.
+            brpc::StreamWait(stream, NULL);
+            continue;
+        }
+        if (rc != 0) {
+            g_error_count << 1;
+            LOG(ERROR) << "Fail to write stream: " << berror(rc);
+            break;
+        }
+        g_latency_recorder << butil::cpuwide_time_us() - start_us;
+    }
+    brpc::StreamClose(stream);
+    return NULL;
+}
+
+static void* publisher(void* arg) {
+    Publisher* p = static_cast<Publisher*>(arg);
+    if (FLAGS_mode == "http") {
+        return publish_by_http(p);
+    } else if (FLAGS_mode == "baidu_std") {
+        return publish_by_baidu_std(p);
+    }
+    return publish_by_stream(p);
+}
+
+int main(int argc, char* argv[]) {
+    GFLAGS_NS::SetUsageMessage("Measure the publish throughput of sps");
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    if (FLAGS_mode != "http" && FLAGS_mode != "baidu_std" && FLAGS_mode != "stream") {
+        LOG(ERROR) << "Unknown mode: " << FLAGS_mode;
+        return -1;
+    }
+
+    Publisher p;
+    p.payload.assign(FLAGS_payload_size, 'x');
+    brpc::ChannelOptions options;
+    options.timeout_ms = FLAGS_timeout_ms;
+    options.protocol = brpc::PROTOCOL_HTTP;
+    if (p.http_channel.Init(FLAGS_server.c_str(), &options) != 0) {
+        LOG(ERROR) << "Fail to initialize http channel";
+        return -1;
+    }
+    options.protocol = brpc::PROTOCOL_BAIDU_STD;
+    if (p.std_channel.Init(FLAGS_server.c_str(), &options) != 0) {
+        LOG(ERROR) << "Fail to initialize baidu_std channel";
+        return -1;
+    }
+
+    std::vector<bthread_t> tids(FLAGS_thread_num);
+    for (int i = 0; i < FLAGS_thread_num; ++i) {
+        if (bthread_start_background(&tids[i], NULL, publisher, &p) != 0) {
+            LOG(ERROR) << "Fail to create bthread";
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < FLAGS_duration_s; ++i) {
+        sleep(1);
+        LOG(INFO) << "mode=" << FLAGS_mode
+                  << " qps=" << g_latency_recorder.qps(1)
+                  << " latency=" << g_latency_recorder.latency(1)
+                  << " error=" << g_error_count.get_value();
+    }
+    g_stop = true;
+    for (int i = 0; i < FLAGS_thread_num; ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    LOG(INFO) << "mode=" << FLAGS_mode
+              << " average_qps=" << g_latency_recorder.count() / std::max(FLAGS_duration_s, 1)
+              << " p99_latency=" << g_latency_recorder.latency_percentile(0.99);
+    return 0;
+}
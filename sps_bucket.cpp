@@ -1,35 +1,122 @@
 #include "sps_bucket.h"
 
+#include <algorithm>
+#include <gflags/gflags.h>
 #include <butil/logging.h>
+#include <butil/time.h>
 #include <butil/strings/string_split.h>
+#include <butil/string_printf.h>
 #include <brpc/builtin/common.h>
 #include <bthread/unstable.h>
+#include <bthread/bthread.h>
+#include <bvar/bvar.h>
 
 
+DEFINE_int32(room_parallel_write_threshold, 50000, "Rooms with more members "
+             "than this are written by several bthreads concurrently, "
+             "non-positive value disables parallel writing");
+DEFINE_int32(room_write_chunk_size, 10000, "The least number of members that "
+             "one bthread writes in a parallel room write");
+DEFINE_int32(room_write_max_parallelism, 8, "The max number of bthreads that "
+             "write one room concurrently");
+DEFINE_int32(dead_session_reap_interval_ms, 200, "Interval between two runs of "
+             "the per-bucket reaper which evicts sessions failed to write");
+DEFINE_int32(dead_session_reap_batch, 1000, "The max number of dead sessions "
+             "evicted in one bucket lock acquisition");
+
 namespace sps {
 
+const size_t Session::npos;
+
+static bvar::Adder<int64_t> g_write_failure("sps_session_write_failure");
+static bvar::PerSecond<bvar::Adder<int64_t> > g_write_failure_second(
+        "sps_session_write_failure_second", &g_write_failure);
+static bvar::Adder<int64_t> g_dead_session_evicted("sps_dead_session_evicted");
+static bvar::Adder<int64_t> g_batched_bytes("sps_session_batched_bytes");
+// the batched bytes left unsent by the sessions destroyed after a failure.
+static bvar::Adder<int64_t> g_batch_dropped_bytes("sps_session_batch_dropped_bytes");
+
+// the bytes of a session and a room, less those of the memberships.
+static const size_t kSessionBytes = sizeof(Session)
+        + sizeof(UserKey) + sizeof(Session::Ptr)      // in sessions_
+        + sizeof(int64_t) + sizeof(Session::Ptr);     // in user_sessions_
+static const size_t kRoomBytes = sizeof(Room) + sizeof(Room::Partition)
+        + sizeof(RoomKey) + sizeof(Room::Ptr);        // in rooms_
+
 ServerOptions::ServerOptions()
     : bucket_size(8)
     , suggested_room_count(128)
-    , suggested_user_count(1024) {
+    , suggested_user_count(1024)
+    , use_execution_queue(false)
+    , max_sessions_per_bucket(0) {
+}
+
+static int64_t get_session_bytes(void* arg) {
+    return static_cast<Bucket*>(arg)->session_bytes();
+}
+
+static int64_t get_room_bytes(void* arg) {
+    return static_cast<Bucket*>(arg)->room_bytes();
 }
 
 Bucket::Bucket(int index, const ServerOptions& options)
-    : index_(index) {
+    : index_(index)
+    , use_queue_(options.use_execution_queue)
+    , lock_stats_(index)
+    , mutex_(&lock_stats_)
+    , publish_epoch_(0)
+    , reaper_tid_(0)
+    , stop_reaper_(false)
+    , last_write_error_(0)
+    , on_session_added_(options.on_session_added)
+    , on_session_removed_(options.on_session_removed)
+    , on_session_rooms_changed_(options.on_session_rooms_changed)
+    , max_sessions_(options.max_sessions_per_bucket)
+    , session_count_(0)
+    , room_count_(0)
+    , membership_count_(0) {
     CHECK_EQ(0, sessions_.init(options.suggested_user_count, 70));
+    CHECK_EQ(0, user_sessions_.init(options.suggested_user_count, 70));
     CHECK_EQ(0, rooms_.init(options.suggested_room_count, 70));
+    if (use_queue_) {
+        bthread::ExecutionQueueOptions queue_options;
+        CHECK_EQ(0, bthread::execution_queue_start(&queue_id_, &queue_options, RunTasks, this));
+    }
+    if (bthread_start_background(&reaper_tid_, NULL, RunReaper, this) != 0) {
+        LOG(ERROR) << "fail to start reaper of bucket[" << index_ << "]";
+        reaper_tid_ = 0;
+    }
+    vars_.emplace_back(new bvar::PassiveStatus<int64_t>(
+            butil::string_printf("sps_bucket_%d_session_bytes", index_),
+            get_session_bytes, this));
+    vars_.emplace_back(new bvar::PassiveStatus<int64_t>(
+            butil::string_printf("sps_bucket_%d_room_bytes", index_),
+            get_room_bytes, this));
     VLOG(51) << "create bucket[" << index_ << "] of"
               << " room=" << options.suggested_room_count
               << " user=" << options.suggested_user_count;
 }
 
 Bucket::~Bucket() {
+    vars_.clear();  // before anything they read
+    if (reaper_tid_) {
+        stop_reaper_ = true;
+        bthread_stop(reaper_tid_);
+        bthread_join(reaper_tid_, NULL);
+    }
+    if (use_queue_) {
+        bthread::execution_queue_stop(queue_id_);
+        bthread::execution_queue_join(queue_id_);
+    }
     VLOG(51) << "destroy bucket[" << index_ << "]";
 }
 
-Room::Room(const RoomKey& key)
-    : key_(key) {
-    CHECK_EQ(0, sessions_.init(8, 70));
+Room::Room(const RoomKey& key, Bucket* bucket, bool single_writer)
+    : key_(key)
+    , bucket_(bucket)
+    , single_writer_(single_writer)
+    , size_(0)
+    , mutex_(bucket ? &bucket->lock_stats() : NULL, &key_) {
     VLOG(51) << "create room[" << room_id() << "]";
 }
 
@@ -38,12 +125,30 @@ Room::~Room() {
 }
 
 Session::Session(const UserKey& key, brpc::ProgressiveAttachment* pa, int anti_idle_s)
+    : Session(key, pa, brpc::INVALID_STREAM_ID, anti_idle_s) {
+}
+
+Session::Session(const UserKey& key, brpc::StreamId stream, int anti_idle_s)
+    : Session(key, NULL, stream, anti_idle_s) {
+}
+
+Session::Session(const UserKey& key, brpc::ProgressiveAttachment* pa, brpc::StreamId stream,
+                 int anti_idle_s)
     : key_(key)
     , writer_(pa)
+    , stream_(stream)
     , created_us_(butil::gettimeofday_us())
     , written_us_(created_us_)
     , anti_idle_us_(anti_idle_s*1000000L)
-    , has_anti_idle_timer_(false) {
+    , has_anti_idle_timer_(false)
+    , dead_(false)
+    , publish_epoch_(0)
+    , batch_window_us_(0)
+    , batch_max_bytes_(0)
+    , framed_(false)
+    , destroyed_(false)
+    , has_batch_timer_(false)
+    , batch_error_(0) {
     if (anti_idle_us_ > 0) {
         // add a ref for OnAntiIdleTimer which does de-ref.
         Session::Ptr add_ref(this);
@@ -57,36 +162,76 @@ Session::Session(const UserKey& key, brpc::ProgressiveAttachment* pa, int anti_i
             has_anti_idle_timer_ = true;
         }
     }
-    VLOG(2) << "create session[" << key_.uid << "," << key_.device_type << "," << writer_.get() << "]";
+    VLOG(2) << "create session[" << key_.uid << "," << key_.device_type << "," << connection_id() << "]";
 }
 
 Session::~Session() {
-    VLOG(2) << "destroy session[" << key_.uid << "," << key_.device_type << "," << writer_.get() << "]";
+    g_batched_bytes << -(int64_t)batched_.size();
+    VLOG(2) << "destroy session[" << key_.uid << "," << key_.device_type << "," << connection_id() << "]";
 }
 
 void Session::Destroy() {
+    // a timer callback running meanwhile finds the session destroyed.
+    BAIDU_SCOPED_LOCK(batch_mutex_);
+    destroyed_ = true;
     if (has_anti_idle_timer_) {
         if (bthread_timer_del(anti_idle_timer_id_) == 0) {
             // The callback is not run yet. Remove the additional ref added
             // before creating the timer.
+            has_anti_idle_timer_ = false;
+            Session::Ptr de_ref(this, false);
+        }
+    }
+    if (has_batch_timer_) {
+        if (bthread_timer_del(batch_timer_id_) == 0) {
+            has_batch_timer_ = false;
             Session::Ptr de_ref(this, false);
         }
     }
+    // the batched events go out before the Wire ends, unless it has failed.
+    if (!batched_.empty()) {
+        const int64_t pending = batched_.size();
+        int err = batch_error_.load(std::memory_order_relaxed);
+        if (err == 0) {
+            err = FlushBatch();
+        } else {
+            g_batched_bytes << -pending;
+            batched_.clear();
+        }
+        if (err) {
+            g_batch_dropped_bytes << pending;
+            LOG_EVERY_SECOND(WARNING) << "drop " << pending << " batched bytes of session["
+                                      << key_.uid << "," << key_.device_type << "]: "
+                                      << berror(err);
+        }
+    }
+    if (stream_ != brpc::INVALID_STREAM_ID) {
+        // the subscriber sees the Wire closed, as a HTTP Wire does.
+        brpc::StreamClose(stream_);
+    }
 }
 
 void Session::OnAntiIdleTimer(void* arg) {
     // hold the referenced session.
     Session::Ptr ps(static_cast<Session*>(arg), false/*not add ref*/);
+    BAIDU_SCOPED_LOCK(ps->batch_mutex_);
+    if (ps->destroyed_) {
+        ps->has_anti_idle_timer_ = false;
+        return;
+    }
     int64_t written_us = ps->written_us_;
     int64_t now_us = butil::gettimeofday_us();
     if ((now_us - written_us) >= ps->anti_idle_us_) {
-        if (ps->writer_) {  // writer could be null when testing
-            if (0 != ps->writer_->Write("\r\n", 2)) {
-                int err = errno;
-                LOG(WARNING) << "fail write to " << *ps << " (" << berror(err) << ") "
-                             << "you probably forget to delete anti-idle timer for this session.";
-                return;
-            }
+        butil::IOBuf crlf;
+        crlf.append("\r\n", 2);
+        int err = ps->Send(crlf);
+        if (err) {
+            // not *ps, whose description takes batch_mutex_ again.
+            LOG(WARNING) << "fail write to session[" << ps->key_.uid << ","
+                         << ps->key_.device_type << "] (" << berror(err) << ") "
+                         << "you probably forget to delete anti-idle timer for this session.";
+            ps->has_anti_idle_timer_ = false;
+            return;
         }
         ps->written_us_ = now_us;
         written_us = now_us;
@@ -104,28 +249,258 @@ void Session::OnAntiIdleTimer(void* arg) {
     }
 }
 
-int Session::Write(const butil::IOBuf& data) {
-    int res;
-    if (0 == writer_->Write(data)) {
-        res = 0;
-    } else {
-        res = errno;
+int Session::Send(const butil::IOBuf& data) {
+    if (writer_) {
+        return writer_->Write(data) == 0 ? 0 : errno;
+    }
+    if (stream_ != brpc::INVALID_STREAM_ID) {
+        // EAGAIN once the subscriber leaves -wire_stream_max_buf_size
+        // unconsumed, which reaps the session like EOVERCROWDED does.
+        return brpc::StreamWrite(stream_, data);
     }
+    return 0;  // no writer when testing
+}
+
+int Session::WriteNow(const butil::IOBuf& data) {
+    int res = Send(data);
     written_us_ = butil::gettimeofday_us();
     return res;
 }
 
-void Room::Write(const butil::IOBuf& data) {
-    BAIDU_SCOPED_LOCK(mutex_);
-    for (Session::Map::iterator it = sessions_.begin(); it != sessions_.end(); ++it) {
-        Session::Ptr session = it->second;
+// Appends `event' framed by its length, see Session::Write.
+static void append_event(const butil::IOBuf& event, butil::IOBuf* out) {
+    char header[24];
+    const int n = snprintf(header, sizeof(header), "%zu\r\n", event.size());
+    out->append(header, n);
+    out->append(event);
+    out->append("\r\n", 2);
+}
+
+int Session::Write(const butil::IOBuf& data) {
+    // report the failure of a previous batch, so that the caller can
+    // evict this session.
+    int err = batch_error_.load(std::memory_order_relaxed);
+    if (err) {
+        return err;
+    }
+
+    BAIDU_SCOPED_LOCK(batch_mutex_);
+    if (destroyed_) {
+        return ECONNRESET;  // not delivered, the Wire is closing
+    }
+    if (batch_window_us_ <= 0 && batched_.empty()) {
+        if (!framed_) {
+            return WriteNow(data);
+        }
+        butil::IOBuf frame;
+        append_event(data, &frame);
+        return WriteNow(frame);
+    }
+    const size_t batched_before = batched_.size();
+    if (framed_) {
+        append_event(data, &batched_);
+    } else {
+        batched_.append(data);
+    }
+    g_batched_bytes << batched_.size() - batched_before;
+    if (batch_window_us_ > 0 && batched_.size() < batch_max_bytes_) {
+        if (has_batch_timer_) {
+            return 0;
+        }
+        // add a ref for OnBatchTimer which does de-ref.
+        Session::Ptr add_ref(this);
+        err = bthread_timer_add(&batch_timer_id_,
+                butil::microseconds_from_now(batch_window_us_),
+                OnBatchTimer, this);
+        if (err == 0) {
+            add_ref.detach();
+            has_batch_timer_ = true;
+            return 0;
+        }
+        LOG(WARNING) << "fail to create timer: " << berror(err);
+    }
+    // full, or batching was just disabled. the armed timer, if any, finds
+    // nothing to flush.
+    return FlushBatch();
+}
+
+int Session::FlushBatch() {
+    if (batched_.empty()) {
+        return 0;
+    }
+    g_batched_bytes << -(int64_t)batched_.size();
+    int err = WriteNow(batched_);
+    batched_.clear();
+    if (err) {
+        batch_error_ = err;
+    }
+    return err;
+}
+
+void Session::OnBatchTimer(void* arg) {
+    // hold the referenced session.
+    Session::Ptr ps(static_cast<Session*>(arg), false/*not add ref*/);
+    BAIDU_SCOPED_LOCK(ps->batch_mutex_);
+    ps->has_batch_timer_ = false;
+    ps->FlushBatch();
+}
+
+void Session::set_framed(bool framed) {
+    BAIDU_SCOPED_LOCK(batch_mutex_);
+    framed_ = framed;
+}
+
+void Session::set_batch(int64_t window_us, size_t max_bytes) {
+    BAIDU_SCOPED_LOCK(batch_mutex_);
+    batch_window_us_ = window_us;
+    batch_max_bytes_ = max_bytes;
+}
+
+size_t Session::batched_bytes() const {
+    BAIDU_SCOPED_LOCK(batch_mutex_);
+    return batched_.size();
+}
+
+// a chunk [begin, end) of a parallel write.
+struct WriteChunkArgs {
+    const std::function<void(size_t, size_t)>* write;
+    size_t begin;
+    size_t end;
+};
+
+static void* run_write_chunk(void* arg) {
+    WriteChunkArgs* a = static_cast<WriteChunkArgs*>(arg);
+    (*a->write)(a->begin, a->end);
+    return NULL;
+}
+
+// Calls `write' for [0, n), split into at most -room_write_max_parallelism
+// chunks written concurrently if `n' is over -room_parallel_write_threshold.
+// The calling thread writes the first chunk while other bthreads write the
+// rest, all of which are joined before returning.
+static void write_in_chunks(size_t n, const std::function<void(size_t, size_t)>& write) {
+    const int threshold = FLAGS_room_parallel_write_threshold;
+    if (threshold <= 0 || n <= (size_t)threshold) {
+        write(0, n);
+        return;
+    }
+    const size_t min_chunk = std::max(FLAGS_room_write_chunk_size, 1);
+    const size_t max_chunks = std::max(FLAGS_room_write_max_parallelism, 1);
+    const size_t nchunk = std::min((n + min_chunk - 1) / min_chunk, max_chunks);
+    const size_t chunk_size = (n + nchunk - 1) / nchunk;
+    std::vector<WriteChunkArgs> args;
+    args.reserve(nchunk);
+    for (size_t off = 0; off < n; off += chunk_size) {
+        WriteChunkArgs a;
+        a.write = &write;
+        a.begin = off;
+        a.end = std::min(off + chunk_size, n);
+        args.push_back(a);
+    }
+    std::vector<bthread_t> tids;
+    tids.reserve(args.size());
+    for (size_t i = 1; i < args.size(); ++i) {
+        bthread_t tid;
+        if (bthread_start_background(&tid, NULL, run_write_chunk, &args[i]) == 0) {
+            tids.push_back(tid);
+        } else {
+            LOG(WARNING) << "fail to start bthread for a parallel write";
+            run_write_chunk(&args[i]);
+        }
+    }
+    run_write_chunk(&args[0]);
+    for (bthread_t tid : tids) {
+        bthread_join(tid, NULL);
+    }
+}
+
+std::unique_lock<InstrumentedMutex> Room::lock(int64_t* wait_us) const {
+    if (single_writer_) {
+        return std::unique_lock<InstrumentedMutex>();
+    }
+    std::unique_lock<InstrumentedMutex> lck(mutex_);
+    if (wait_us) {
+        *wait_us = mutex_.wait_us();
+    }
+    return lck;
+}
+
+std::vector<Room::Member>& Room::mutable_members(Partition* p) {
+    if (p->members.use_count() > 1) {
+        // pinned by a publish in flight, which keeps the array as it is.
+        p->members.reset(new std::vector<Member>(*p->members));
+    } else {
+        // the publishes that have unpinned it are done reading.
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    return *p->members;
+}
+
+size_t Room::pin_members(int device_type, std::vector<Pinned>* pinned, int64_t* wait_us) const {
+    size_t n = 0;
+    int64_t lock_wait_us = 0;
+    std::unique_lock<InstrumentedMutex> lck = lock(&lock_wait_us);
+    *wait_us += lock_wait_us;
+    for (const Partition& p : partitions_) {
+        if ((device_type < 0 || p.device_type == device_type) && !p.members->empty()) {
+            pinned->push_back(p.members);
+            n += p.members->size();
+        }
+    }
+    return n;
+}
+
+void Room::Write(const butil::IOBuf& data, int device_type, PublishTrace* trace) {
+    // pin the member arrays of the partitions written, so that the room
+    // lock is held only for taking the pins. Joining or leaving the room
+    // meanwhile changes a copy of the array.
+    std::vector<Pinned> pinned;
+    int64_t wait_us = 0;
+    const size_t n = pin_members(device_type, &pinned, &wait_us);
+    if (trace) {
+        trace->AddRoomWait(wait_us);
+    }
+    bucket_->hot_rooms().Update(key_, n, data.size());
+    write_in_chunks(n, [&](size_t begin, size_t end) {
+        // a chunk may span the arrays of several partitions.
+        size_t offset = 0;
+        for (const Pinned& members : pinned) {
+            const size_t m = members->size();
+            if (offset < end && offset + m > begin) {
+                const size_t from = begin > offset ? begin - offset : 0;
+                const size_t to = std::min(end - offset, m);
+                WriteMembers(members->data() + from, members->data() + to, data, trace);
+            }
+            offset += m;
+        }
+    });
+}
+
+void Room::WriteMembers(const Member* begin, const Member* end, const butil::IOBuf& data,
+                        PublishTrace* trace) const {
+    // walk the dense member array; taking the session by raw pointer
+    // avoids touching its refcount.
+    int64_t first_us = 0;
+    for (const Member* m = begin; m != end; ++m) {
+        Session* session = m->session.get();
+        if (session->is_dead()) {
+            continue;  // waiting for the reaper
+        }
         int err = session->Write(data);
         if (err) {
-            LOG(WARNING) << "fail write to " << *session << " " << berror(err);
+            bucket_->on_write_failed(session, err);
+        } else if (trace && first_us == 0) {
+            first_us = butil::cpuwide_time_us();
         }
     }
+    if (first_us) {
+        // stamped once per chunk, not per session.
+        trace->AddWrites(first_us, butil::cpuwide_time_us());
+    }
 }
 
+// Must not be called while the session is in a bucket, since the room
+// back-indices are reset.
 void Session::set_interested_room(const std::string& rooms) {
     BAIDU_SCOPED_LOCK(mutex_);
     interested_rooms_.clear();
@@ -133,8 +508,63 @@ void Session::set_interested_room(const std::string& rooms) {
     butil::SplitString(rooms, ',', &pieces);
     for (const std::string& s : pieces) {
         if (s.empty()) continue;
-        interested_rooms_.emplace_back(RoomKey(s));
+        RoomKey key(s);
+        if (std::find(interested_rooms_.begin(), interested_rooms_.end(), key)
+                != interested_rooms_.end()) {
+            continue;  // joins a room only once
+        }
+        interested_rooms_.push_back(key);
     }
+    room_slots_.assign(interested_rooms_.size(), npos);
+}
+
+template <typename Fn>
+int64_t Bucket::exclusive(const Fn& fn, bool wait) const {
+    if (!use_queue_) {
+        BAIDU_SCOPED_LOCK(mutex_);
+        const int64_t wait_us = mutex_.wait_us();
+        fn();
+        return wait_us;
+    }
+    int64_t wait_us = 0;
+    Task task;
+    task.fn = fn;
+    task.done = NULL;
+    task.enqueued_us = butil::cpuwide_time_us();
+    task.wait_us = NULL;
+    bthread::CountdownEvent done(1);
+    if (wait) {
+        task.done = &done;
+        task.wait_us = &wait_us;
+    }
+    if (bthread::execution_queue_execute(queue_id_, task) != 0) {
+        LOG(ERROR) << "fail to execute in the queue of bucket[" << index_ << "]";
+        return 0;
+    }
+    if (wait) {
+        done.wait();
+    }
+    return wait_us;
+}
+
+int Bucket::RunTasks(void* meta, bthread::TaskIterator<Task>& iter) {
+    LockStats& stats = static_cast<Bucket*>(meta)->lock_stats_;
+    for (; iter; ++iter) {
+        // the time in the queue is the lock wait of a single-writer bucket,
+        // and running the task is the hold.
+        const int64_t start_us = butil::cpuwide_time_us();
+        const int64_t wait_us = start_us - iter->enqueued_us;
+        stats.bucket_wait << wait_us;
+        if (iter->wait_us) {
+            *iter->wait_us = wait_us;
+        }
+        iter->fn();
+        stats.bucket_hold << butil::cpuwide_time_us() - start_us;
+        if (iter->done) {
+            iter->done->signal();
+        }
+    }
+    return 0;
 }
 
 void Bucket::add_session(Session* session) {
@@ -146,125 +576,577 @@ void Bucket::add_session(Session* session) {
 
 void Bucket::add_session(Session::Ptr ps) {
     CHECK(ps.get() != nullptr);
-    Session::Ptr old_ps = del_session(ps->key());
+
+    if (use_queue_) {
+        // the subscriber does not wait for the queue.
+        exclusive([this, ps] {
+            Session::Ptr old_ps = replace_session(ps);
+            if (old_ps) {
+                old_ps->Destroy();
+                LOG(WARNING) << "removed existing session: " << *old_ps;
+            }
+        }, false);
+        return;
+    }
+
+    Session::Ptr old_ps;
+    exclusive([&] { old_ps = replace_session(ps); });
     if (old_ps) {
         old_ps->Destroy();
         LOG(WARNING) << "removed existing session: " << *old_ps;
     }
+}
 
-    std::vector<RoomKey> room_keys = ps->interested_rooms();
-    std::vector<Room::Ptr> interested_rooms;
+Session::Ptr Bucket::replace_session(const Session::Ptr& ps) {
+    Session::Ptr old_ps;
+    Session::Ptr* pps = sessions_.seek(ps->key());
+    if (pps) {
+        old_ps = *pps;
+        detach_rooms(old_ps, old_ps->interested_rooms());
+        unlink_user(old_ps);
+        if (on_session_removed_) {
+            on_session_removed_(*old_ps);  // before the new one is added
+        }
+    } else {
+        session_count_.fetch_add(1, std::memory_order_relaxed);
+    }
+    sessions_[ps->key()] = ps;
+    link_user(ps);
+    attach_rooms(ps, ps->interested_rooms());
+    if (on_session_added_) {
+        on_session_added_(*ps);
+    }
+    return old_ps;
+}
 
-    {
-        BAIDU_SCOPED_LOCK(mutex_);
-        sessions_[ps->key()] = ps;
+Session::Ptr Bucket::del_session(const UserKey &key) {
+    Session::Ptr ps;
+    exclusive([&] { ps = remove_session(key, NULL); });
+    return ps;
+}
+
+Session::Ptr Bucket::remove_session(const UserKey& key, const Session* only) {
+    Session::Ptr* pps = sessions_.seek(key);
+    if (pps == NULL || (only && pps->get() != only)) {
+        return Session::Ptr();
+    }
+    Session::Ptr ps = *pps;
+    detach_rooms(ps, ps->interested_rooms());
+    unlink_user(ps);
+    sessions_.erase(key);
+    session_count_.fetch_sub(1, std::memory_order_relaxed);
+    if (on_session_removed_) {
+        on_session_removed_(*ps);
+    }
+    return ps;
+}
+
+void Bucket::attach_rooms(const Session::Ptr& ps, const std::vector<RoomKey>& room_keys) {
+    for (size_t i = 0; i < room_keys.size(); ++i) {
         // create room as needed
-        for (const RoomKey& key : room_keys) {
-            Room::Ptr room = rooms_[key];
-            if (!room) {
-                room.reset(new Room(key));
-                rooms_[key] = room;
-            }
-            interested_rooms.push_back(room);
+        Room::Ptr& room = rooms_[room_keys[i]];
+        if (!room) {
+            room.reset(new Room(room_keys[i], this, use_queue_));
+            room_count_.fetch_add(1, std::memory_order_relaxed);
         }
+        room->add_session(ps, i);
     }
+    membership_count_.fetch_add(room_keys.size(), std::memory_order_relaxed);
+}
 
-    for (Room::Ptr pr : interested_rooms) {
-        pr->add_session(ps);
+void Bucket::detach_rooms(const Session::Ptr& ps, const std::vector<RoomKey>& room_keys) {
+    for (size_t i = 0; i < room_keys.size(); ++i) {
+        Room::Ptr* ppr = rooms_.seek(room_keys[i]);
+        if (ppr && (*ppr)->del_session(ps.get(), i)) {
+            rooms_.erase(room_keys[i]);
+            room_count_.fetch_sub(1, std::memory_order_relaxed);
+        }
     }
+    membership_count_.fetch_sub(room_keys.size(), std::memory_order_relaxed);
 }
 
-Session::Ptr Bucket::del_session(const UserKey &key) {
-    Session::Ptr ps = get_session(key);
-    if (!ps) {
-        return ps;
+void Bucket::link_user(const Session::Ptr& ps) {
+    user_sessions_[ps->key().uid].push_back(ps);
+}
+
+void Bucket::unlink_user(const Session::Ptr& ps) {
+    std::vector<Session::Ptr>* terminals = user_sessions_.seek(ps->key().uid);
+    if (terminals == NULL) {
+        return;
+    }
+    std::vector<Session::Ptr>::iterator it =
+        std::find(terminals->begin(), terminals->end(), ps);
+    if (it != terminals->end()) {
+        it->swap(terminals->back());
+        terminals->pop_back();
+    }
+    if (terminals->empty()) {
+        user_sessions_.erase(ps->key().uid);
     }
+}
 
-    std::vector<RoomKey> room_keys = ps->interested_rooms();
-    std::vector< std::pair<Room::Ptr, bool> > interested_rooms;
+std::vector<Session::Ptr> Bucket::get_user_sessions(int64_t uid) const {
+    std::vector<Session::Ptr> result;
+    exclusive([&] {
+        std::vector<Session::Ptr>* terminals = user_sessions_.seek(uid);
+        if (terminals) {
+            for (const Session::Ptr& ps : *terminals) {
+                if (!ps->is_dead()) {
+                    result.push_back(ps);
+                }
+            }
+        }
+    });
+    return result;
+}
 
-    {
-        BAIDU_SCOPED_LOCK(mutex_);
-        for (const RoomKey& key : room_keys) {
+void Bucket::write_room(const RoomKey& key, const butil::IOBuf& data, int device_type,
+                        const PublishTrace::Ptr& trace) {
+    if (use_queue_) {
+        // the room is written by the consumer, without any lock. the trace
+        // is released when the last bucket has written.
+        const int64_t enqueued_us = butil::cpuwide_time_us();
+        exclusive([this, key, data, device_type, trace, enqueued_us] {
+            if (trace) {
+                trace->AddBucketWait(butil::cpuwide_time_us() - enqueued_us);
+            }
             Room::Ptr* ppr = rooms_.seek(key);
             if (ppr) {
-                interested_rooms.push_back(std::make_pair(*ppr, false));
+                (*ppr)->Write(data, device_type, trace.get());
             }
+        }, false);
+        return;
+    }
+    Room::Ptr pr;
+    const int64_t wait_us = exclusive([&] {
+        Room::Ptr* ppr = rooms_.seek(key);
+        if (ppr) {
+            pr = *ppr;
         }
+    });
+    if (trace) {
+        trace->AddBucketWait(wait_us);
     }
+    if (pr) {
+        pr->Write(data, device_type, trace.get());
+    }
+}
 
-    for (std::pair<Room::Ptr, bool>& pair : interested_rooms) {
-        pair.second = (pair.first)->del_session(ps);
+size_t Bucket::write_rooms(const std::vector<RoomKey>& room_keys, const butil::IOBuf& data,
+                           int device_type, const PublishTrace::Ptr& trace) {
+    std::vector<Room::Ptr> rooms;
+    std::vector<Room::Pinned> pinned;
+    // counted for the hot rooms after releasing the bucket.
+    std::vector<size_t> room_sizes;
+    int64_t room_wait_us = 0;
+    auto pin_rooms = [&] {
+        room_sizes.reserve(rooms.size());
+        for (const Room::Ptr& pr : rooms) {
+            room_sizes.push_back(pr->pin_members(device_type, &pinned, &room_wait_us));
+        }
+    };
+    const int64_t wait_us = exclusive([&] {
+        rooms.reserve(room_keys.size());
+        for (const RoomKey& key : room_keys) {
+            Room::Ptr* ppr = rooms_.seek(key);
+            if (ppr) {
+                rooms.push_back(*ppr);
+            }
+        }
+        if (use_queue_) {
+            pin_rooms();  // single-writer rooms are read by the consumer only
+        }
+    });
+    if (!use_queue_) {
+        pin_rooms();
+    }
+    for (size_t i = 0; i < rooms.size(); ++i) {
+        hot_rooms_.Update(rooms[i]->key(), room_sizes[i], data.size());
     }
 
+    // the sessions are kept alive by the pins while written by raw pointer.
+    std::vector<Session*> targets;
     {
-        BAIDU_SCOPED_LOCK(mutex_);
-        for (std::pair<Room::Ptr, bool>& pair : interested_rooms) {
-            if (pair.second) {
-                rooms_.erase(pair.first->key());
+        BAIDU_SCOPED_LOCK(publish_mutex_);
+        const uint64_t epoch = ++publish_epoch_;
+        for (const Room::Pinned& members : pinned) {
+            for (const Room::Member& m : *members) {
+                Session* session = m.session.get();
+                if (session->publish_epoch_ != epoch) {
+                    session->publish_epoch_ = epoch;
+                    targets.push_back(session);
+                }
             }
         }
-        sessions_.erase(key);
     }
 
-    return ps;
+    std::atomic<size_t> written(0);
+    write_in_chunks(targets.size(), [&](size_t begin, size_t end) {
+        size_t n = 0;
+        int64_t first_us = 0;
+        for (size_t i = begin; i < end; ++i) {
+            Session* session = targets[i];
+            if (session->is_dead()) {
+                continue;
+            }
+            int err = session->Write(data);
+            if (err) {
+                on_write_failed(session, err);
+            } else if (++n == 1) {
+                first_us = butil::cpuwide_time_us();
+            }
+        }
+        if (n) {
+            written.fetch_add(n, std::memory_order_relaxed);
+            if (trace) {
+                trace->AddWrites(first_us, butil::cpuwide_time_us());
+            }
+        }
+    });
+    if (trace) {
+        trace->AddBucketWait(wait_us);
+        trace->AddRoomWait(room_wait_us);
+    }
+    return written.load(std::memory_order_relaxed);
 }
 
-Session::Ptr Bucket::get_session(const UserKey& key) const {
-    BAIDU_SCOPED_LOCK(mutex_);
-    Session::Ptr* pps = sessions_.seek(key);
-    if (pps == NULL) {
-        return Session::Ptr();
-    } else {
-        return *pps;
+void Bucket::write_all(const butil::IOBuf& data, int device_type,
+                       size_t* delivered, size_t* failed) {
+    std::vector<Session::Ptr> snapshot;
+    exclusive([&] {
+        snapshot.reserve(sessions_.size());
+        for (Session::Map::const_iterator it = sessions_.begin(); it != sessions_.end(); ++it) {
+            if (device_type < 0 || it->first.device_type == device_type) {
+                snapshot.push_back(it->second);
+            }
+        }
+    });
+
+    *delivered = 0;
+    *failed = 0;
+    for (const Session::Ptr& ps : snapshot) {
+        if (ps->is_dead()) {
+            continue;
+        }
+        int err = ps->Write(data);
+        if (err) {
+            on_write_failed(ps.get(), err);
+            ++*failed;
+        } else {
+            ++*delivered;
+        }
     }
 }
 
-Room::Ptr Bucket::get_room(const RoomKey& key) const {
-    BAIDU_SCOPED_LOCK(mutex_);
-    Room::Ptr* ppr = rooms_.seek(key);
-    if (ppr == NULL) {
-        return Room::Ptr();
-    } else {
-        return *ppr;
+void Bucket::on_write_failed(Session* session, int err) {
+    g_write_failure << 1;
+    if (!session->set_dead()) {
+        return;  // already queued
     }
+    BAIDU_SCOPED_LOCK(dead_mutex_);
+    dead_sessions_.push_back(Session::Ptr(session));
+    last_write_error_ = err;
+}
+
+std::vector<Session::Ptr> Bucket::evict_sessions(const RoomKey* room,
+                                                 int64_t min_uid, int64_t max_uid) {
+    std::vector<Session::Ptr> targets;
+    exclusive([&] {
+        if (room) {
+            Room::Ptr* ppr = rooms_.seek(*room);
+            if (ppr) {
+                targets.reserve((*ppr)->size());
+                for (const Room::Partition& p : (*ppr)->partitions_) {
+                    for (const Room::Member& m : *p.members) {
+                        targets.push_back(m.session);
+                    }
+                }
+            }
+            return;
+        }
+        for (Session::Map::const_iterator it = sessions_.begin(); it != sessions_.end(); ++it) {
+            if (it->first.uid >= min_uid && it->first.uid <= max_uid) {
+                targets.push_back(it->second);
+            }
+        }
+    });
+
+    // subscribes and publishes get the bucket between the batches.
+    const size_t batch = std::max(FLAGS_dead_session_reap_batch, 1);
+    for (size_t begin = 0; begin < targets.size(); begin += batch) {
+        const size_t end = std::min(begin + batch, targets.size());
+        exclusive([&] {
+            for (size_t i = begin; i < end; ++i) {
+                Session::Ptr& ps = targets[i];
+                if (!remove_session(ps->key(), ps.get())) {
+                    ps.reset();  // already removed or replaced
+                    continue;
+                }
+                ps->set_dead();  // skipped by the fan-outs in flight
+            }
+        });
+    }
+    targets.erase(std::remove_if(targets.begin(), targets.end(),
+                                 [](const Session::Ptr& ps) { return !ps; }),
+                  targets.end());
+    return targets;
+}
+
+void* Bucket::RunReaper(void* arg) {
+    Bucket* bucket = static_cast<Bucket*>(arg);
+    int64_t unlogged = 0;
+    int64_t last_log_us = butil::gettimeofday_us();
+    while (!bucket->stop_reaper_) {
+        unlogged += bucket->reap_dead_sessions();
+        int64_t now_us = butil::gettimeofday_us();
+        if (unlogged > 0 && now_us - last_log_us >= 1000000L) {
+            int err;
+            {
+                BAIDU_SCOPED_LOCK(bucket->dead_mutex_);
+                err = bucket->last_write_error_;
+            }
+            LOG(WARNING) << "bucket[" << bucket->index_ << "] evicted " << unlogged
+                         << " dead sessions in the last " << (now_us - last_log_us) / 1000
+                         << "ms, last error: " << berror(err);
+            unlogged = 0;
+            last_log_us = now_us;
+        }
+        bthread_usleep(std::max(FLAGS_dead_session_reap_interval_ms, 1) * 1000L);
+    }
+    return NULL;
+}
+
+size_t Bucket::reap_dead_sessions() {
+    std::vector<Session::Ptr> dead;
+    {
+        BAIDU_SCOPED_LOCK(dead_mutex_);
+        dead.swap(dead_sessions_);
+    }
+
+    size_t evicted = 0;
+    const size_t batch = std::max(FLAGS_dead_session_reap_batch, 1);
+    for (size_t begin = 0; begin < dead.size(); begin += batch) {
+        const size_t end = std::min(begin + batch, dead.size());
+        exclusive([&] {
+            for (size_t i = begin; i < end; ++i) {
+                Session::Ptr& ps = dead[i];
+                if (!remove_session(ps->key(), ps.get())) {
+                    ps.reset();  // already removed or replaced
+                    continue;
+                }
+                ++evicted;
+            }
+        });
+    }
+
+    for (Session::Ptr& ps : dead) {
+        if (ps) {
+            ps->Destroy();
+        }
+    }
+    g_dead_session_evicted << evicted;
+    return evicted;
+}
+
+Session::Ptr Bucket::get_session(const UserKey& key) const {
+    Session::Ptr ps;
+    exclusive([&] {
+        Session::Ptr* pps = sessions_.seek(key);
+        if (pps) {
+            ps = *pps;
+        }
+    });
+    return ps;
+}
+
+Room::Ptr Bucket::get_room(const RoomKey& key) const {
+    Room::Ptr pr;
+    exclusive([&] {
+        Room::Ptr* ppr = rooms_.seek(key);
+        if (ppr) {
+            pr = *ppr;
+        }
+    });
+    return pr;
+}
+
+bool Bucket::list_sessions(SessionCursor* cursor, size_t max,
+                           std::vector<UserKey>* keys) const {
+    bool more = false;
+    exclusive([&] {
+        // the hint survives the changes of the map in between.
+        Session::Map::const_iterator it = cursor->started
+                ? sessions_.restore_iterator(cursor->hint) : sessions_.begin();
+        cursor->started = true;
+        for (size_t n = 0; it != sessions_.end() && n < max; ++it, ++n) {
+            keys->push_back(it->first);
+        }
+        if (it != sessions_.end()) {
+            sessions_.save_iterator(it, &cursor->hint);
+            more = true;
+        }
+    });
+    return more;
+}
+
+bool Bucket::list_room_members(const RoomKey& key, size_t* cursor, size_t max,
+                               std::vector<UserKey>* keys) const {
+    bool more = false;
+    exclusive([&] {
+        Room::Ptr* ppr = rooms_.seek(key);
+        if (ppr == NULL) {
+            return;
+        }
+        // `cursor' indexes the members of all the partitions in order,
+        // which are only appended.
+        size_t skip = *cursor;
+        size_t n = 0;
+        for (const Room::Partition& p : (*ppr)->partitions_) {
+            if (skip >= p.members->size()) {
+                skip -= p.members->size();
+                continue;
+            }
+            for (size_t i = skip; i < p.members->size(); ++i) {
+                if (n == max) {
+                    more = true;
+                    break;
+                }
+                keys->push_back((*p.members)[i].session->key());
+                ++n;
+            }
+            skip = 0;
+            if (more) {
+                break;
+            }
+        }
+        *cursor += n;
+    });
+    return more;
 }
 
 size_t Bucket::count_session() const {
-    BAIDU_SCOPED_LOCK(mutex_);
-    return sessions_.size();
+    size_t n = 0;
+    exclusive([&] { n = sessions_.size(); });
+    return n;
 }
 
 size_t Bucket::count_room() const {
-    BAIDU_SCOPED_LOCK(mutex_);
-    return rooms_.size();
+    size_t n = 0;
+    exclusive([&] { n = rooms_.size(); });
+    return n;
 }
 
-void Room::add_session(Session::Ptr ps) {
-    CHECK(ps.get() != nullptr);
+int64_t Bucket::session_bytes() const {
+    return session_count_.load(std::memory_order_relaxed) * kSessionBytes
+        + membership_count_.load(std::memory_order_relaxed) * (sizeof(RoomKey) + sizeof(size_t));
+}
 
-    BAIDU_SCOPED_LOCK(mutex_);
-    sessions_[ps->key()] = ps;
+int64_t Bucket::room_bytes() const {
+    return room_count_.load(std::memory_order_relaxed) * kRoomBytes
+        + membership_count_.load(std::memory_order_relaxed) * sizeof(Room::Member);
+}
+
+Room::Partition* Room::partition(int16_t device_type, bool create) {
+    for (Partition& p : partitions_) {
+        if (p.device_type == device_type) {
+            return &p;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    partitions_.push_back(Partition(device_type));
+    return &partitions_.back();
+}
+
+const Room::Partition* Room::partition(int16_t device_type) const {
+    for (const Partition& p : partitions_) {
+        if (p.device_type == device_type) {
+            return &p;
+        }
+    }
+    return NULL;
 }
 
-bool Room::del_session(Session::Ptr ps) {
+void Room::add_session(const Session::Ptr& ps, size_t room_index) {
     CHECK(ps.get() != nullptr);
 
-    BAIDU_SCOPED_LOCK(mutex_);
-    sessions_.erase(ps->key());
-    return sessions_.empty();
+    std::unique_lock<InstrumentedMutex> lck = lock();
+    std::vector<Member>& members = mutable_members(partition(ps->key().device_type, true));
+    ps->room_slots_[room_index] = members.size();
+    members.push_back(Member(ps, room_index));
+    size_.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool Room::del_session(Session* session, size_t room_index) {
+    CHECK(session != nullptr);
+
+    std::unique_lock<InstrumentedMutex> lck = lock();
+    Partition* p = partition(session->key().device_type, false);
+    size_t slot = session->room_slots_[room_index];
+    if (p && slot < p->members->size() && (*p->members)[slot].session.get() == session) {
+        std::vector<Member>& members = mutable_members(p);
+        // swap the last member into the hole and fix its back-index.
+        if (slot != members.size() - 1) {
+            members[slot] = std::move(members.back());
+            Member& moved = members[slot];
+            moved.session->room_slots_[moved.room_index] = slot;
+        }
+        members.pop_back();
+        if (members.empty()) {
+            // drop the partition, so that terminal types gone from the room
+            // are not walked or kept by it. A publish pinning the members
+            // holds its own reference.
+            if (p != &partitions_.back()) {
+                *p = std::move(partitions_.back());
+            }
+            partitions_.pop_back();
+        }
+        session->room_slots_[room_index] = Session::npos;
+        size_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    return size_.load(std::memory_order_relaxed) == 0;
 }
 
 size_t Room::size() const {
-    BAIDU_SCOPED_LOCK(mutex_);
-    return sessions_.size();
+    return size_.load(std::memory_order_relaxed);
+}
+
+template <typename Fn>
+void Room::read(const Fn& fn) const {
+    if (single_writer_) {
+        bucket_->exclusive(fn);
+        return;
+    }
+    std::unique_lock<InstrumentedMutex> lck = lock();
+    fn();
+}
+
+size_t Room::memory_bytes() const {
+    size_t bytes = sizeof(Room) + sizeof(RoomKey) + sizeof(Room::Ptr);
+    read([&] {
+        bytes += partitions_.capacity() * sizeof(Partition);
+        for (const Partition& p : partitions_) {
+            bytes += p.members->capacity() * sizeof(Member);
+        }
+    });
+    return bytes;
 }
 
 bool Room::has_session(Session::Ptr ps) const {
     CHECK(ps.get() != nullptr);
 
-    BAIDU_SCOPED_LOCK(mutex_);
-    return sessions_.seek(ps->key()) != NULL;
+    size_t room_index = ps->interested_room_index(key_);
+    if (room_index == Session::npos) {
+        return false;
+    }
+    bool found = false;
+    read([&] {
+        const Partition* p = partition(ps->key().device_type);
+        size_t slot = ps->room_slots_[room_index];
+        found = p && slot < p->members->size() && (*p->members)[slot].session == ps;
+    });
+    return found;
 }
 
 std::vector<RoomKey> Session::interested_rooms() const {
@@ -272,12 +1154,35 @@ std::vector<RoomKey> Session::interested_rooms() const {
     return interested_rooms_;
 }
 
+size_t Session::memory_bytes() const {
+    size_t bytes = sizeof(Session) + sizeof(UserKey) + sizeof(Session::Ptr);
+    {
+        BAIDU_SCOPED_LOCK(mutex_);
+        bytes += interested_rooms_.capacity() * sizeof(RoomKey)
+            + room_slots_.capacity() * sizeof(size_t);
+    }
+    return bytes + batched_bytes();
+}
+
+size_t Session::interested_room_index(const RoomKey& key) const {
+    BAIDU_SCOPED_LOCK(mutex_);
+    for (size_t i = 0; i < interested_rooms_.size(); ++i) {
+        if (interested_rooms_[i] == key) {
+            return i;
+        }
+    }
+    return npos;
+}
+
 void Session::Describe(std::ostream& os, const brpc::DescribeOptions&) const {
     os << "sps::Session { uid=" << key_.uid
        << " device_type=" << key_.device_type
-       << " connection_id=" << writer_.get()
+       << " connection_id=" << connection_id()
        << " created_on=" << brpc::PrintedAsDateTime(created_us_)
        << " written_on=" << brpc::PrintedAsDateTime(written_us_);
+    if (is_dead()) {
+        os << " dead";
+    }
     std::vector<RoomKey> rooms = interested_rooms();
     for (std::vector<RoomKey>::const_iterator it = rooms.begin();
          it != rooms.end(); ++it) {
@@ -286,45 +1191,55 @@ void Session::Describe(std::ostream& os, const brpc::DescribeOptions&) const {
         }
         os << it->room_id() << ",";
     }
+    os << " memory_bytes=" << memory_bytes();
     os << " }";
 }
 
 void Bucket::Describe(std::ostream& os, const brpc::DescribeOptions&) const {
-    BAIDU_SCOPED_LOCK(mutex_);
-    os << "sps::Bucket { index=" << index_
-       << " sessions=" << sessions_.size()
-       << " rooms=" << rooms_.size();
-    size_t crowded = 0;
-    for (Room::Map::const_iterator it = rooms_.begin(); it != rooms_.end(); ++it) {
-        Room::Ptr room = it->second;
-        if (room->size() > crowded) {
-            crowded = room->size();
+    exclusive([&] {
+        os << "sps::Bucket { index=" << index_
+           << " sessions=" << sessions_.size()
+           << " rooms=" << rooms_.size();
+        size_t crowded = 0;
+        for (Room::Map::const_iterator it = rooms_.begin(); it != rooms_.end(); ++it) {
+            Room::Ptr room = it->second;
+            if (room->size() > crowded) {
+                crowded = room->size();
+            }
         }
-    }
-    os << " crowded=" << crowded;
-    os << " }";
+        os << " crowded=" << crowded
+           << " session_bytes=" << session_bytes()
+           << " room_bytes=" << room_bytes();
+        os << " }";
+    });
 }
 
 void Bucket::update_session_rooms(const UserKey& key, const std::string& new_rooms) {
-    if (session_rooms_unchanged(key, new_rooms)) {
+    if (use_queue_) {
+        exclusive([this, key, new_rooms] { change_session_rooms(key, new_rooms); }, false);
         return;
     }
+    exclusive([&] { change_session_rooms(key, new_rooms); });
+}
 
-    Session::Ptr ps = del_session(key);
-    if (!ps) {
+void Bucket::change_session_rooms(const UserKey& key, const std::string& new_rooms) {
+    Session::Ptr* pps = sessions_.seek(key);
+    if (pps == NULL) {
         return;
     }
-
+    Session::Ptr ps = *pps;
+    if (session_rooms_unchanged(ps, new_rooms)) {
+        return;
+    }
+    detach_rooms(ps, ps->interested_rooms());
     ps->set_interested_room(new_rooms);
-    add_session(ps);
-}
-
-bool Bucket::session_rooms_unchanged(const UserKey& key, const std::string& new_rooms) const {
-    Session::Ptr ps = get_session(key);
-    if (!ps) {
-        return true;
+    attach_rooms(ps, ps->interested_rooms());
+    if (on_session_rooms_changed_) {
+        on_session_rooms_changed_(*ps);
     }
+}
 
+bool Bucket::session_rooms_unchanged(const Session::Ptr& ps, const std::string& new_rooms) const {
     std::string cur_rooms;
     for (const RoomKey& key : ps->interested_rooms()) {
         cur_rooms += key.room_id();
@@ -3,21 +3,50 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <butil/hash.h>
+#include <butil/iobuf.h>
 #include <brpc/shared_object.h>
 #include <brpc/describable.h>
 #include <brpc/progressive_attachment.h>
+#include <brpc/stream.h>
 #include <bthread/mutex.h>
+#include <bthread/execution_queue.h>
+#include <bthread/countdown_event.h>
 #include <butil/containers/flat_map.h>
+#include "sps_hot_room.h"
+#include "sps_lock.h"
+#include "sps_trace.h"
 
+namespace bvar {
+class Variable;
+}
 
 namespace sps {
 
+class Session;
+
 struct ServerOptions {
     ServerOptions();
     size_t bucket_size;
     size_t suggested_room_count;
     size_t suggested_user_count;
+    // Operate each bucket by the single consumer of its execution queue,
+    // instead of the bucket and room locks.
+    bool use_execution_queue;
+    // A bucket is full with this many sessions, 0 for no limit.
+    size_t max_sessions_per_bucket;
+    // Called with exclusive access to a bucket as a session joins it, and
+    // as it leaves, whether replaced, unsubscribed, reaped or evicted. Must
+    // not block, see TrafficCapture.
+    std::function<void(const Session&)> on_session_added;
+    std::function<void(const Session&)> on_session_removed;
+    // Called likewise after the rooms of a session are changed by
+    // Bucket::update_session_rooms.
+    std::function<void(const Session&)> on_session_rooms_changed;
 };
 
 struct UserKey {
@@ -26,6 +55,7 @@ struct UserKey {
             return butil::Hash((char*)&key.uid, 10);
         }
     };
+    UserKey() : uid(0), device_type(0) {}  // for the position hints of Session::Map
     explicit UserKey(int64_t uid, int16_t device_type = 0) : uid(uid), device_type(device_type) {}
     bool operator==(const UserKey& rhs) const {
         return uid == rhs.uid
@@ -53,35 +83,96 @@ struct RoomKey {
     char roomid[37];
 };
 
+class Room;
+class Bucket;
+
 class Session : public brpc::SharedObject,
                 public brpc::Describable {
+    friend class Room;
+    friend class Bucket;
+
 public:
     typedef butil::intrusive_ptr<Session> Ptr;
     typedef butil::FlatMap<UserKey, Session::Ptr, UserKey::Hasher> Map;
+    static const size_t npos = static_cast<size_t>(-1);
 
     Session(const UserKey& key, brpc::ProgressiveAttachment* pa, int anti_idle_s=0);
+    // A session whose events are the messages of `stream', see
+    // SubscribeService. The stream is closed when the session is destroyed.
+    Session(const UserKey& key, brpc::StreamId stream, int anti_idle_s=0);
     ~Session();
+    // Writes `data' as one event, in the order written. Fails with
+    // ECONNRESET after Destroy().
     int Write(const butil::IOBuf& data);
     void set_interested_room(const std::string& rooms);
+    // Frames every event as "<length>\r\n<data>\r\n", so that subscribers
+    // tell apart the events of a batch, and from the anti-idle CRLF. Only
+    // for subscribers asking for it, the others get the events as written.
+    void set_framed(bool framed);
+    // Coalesces events written within `window_us' into one write, which is
+    // issued earlier if `max_bytes' are pending. Non-positive `window_us'
+    // disables batching. Meant for framed sessions.
+    void set_batch(int64_t window_us, size_t max_bytes);
+    size_t batched_bytes() const;
     void Destroy();
 
     std::vector<RoomKey> interested_rooms() const;
+    size_t interested_room_index(const RoomKey& key) const;
+    // The bytes held by this session and its rooms, plus the events batched
+    // but not written. The buffers of brpc are not counted, but capped by
+    // -socket_max_unwritten_bytes.
+    size_t memory_bytes() const;
     void Describe(std::ostream& os, const brpc::DescribeOptions&) const;
     const UserKey& key() const { return key_; }
-    void* connection_id() const { return writer_.get(); }
+    void* connection_id() const {
+        return writer_ ? (void*)writer_.get() : stream_connection_id(stream_);
+    }
+    static void* stream_connection_id(brpc::StreamId stream) {
+        return stream == brpc::INVALID_STREAM_ID ? NULL : (void*)(uintptr_t)stream;
+    }
+    bool is_dead() const { return dead_.load(std::memory_order_relaxed); }
+    // Returns true if the session was alive before.
+    bool set_dead() { return !dead_.exchange(true, std::memory_order_relaxed); }
 
 private:
+    Session(const UserKey& key, brpc::ProgressiveAttachment* pa, brpc::StreamId stream,
+            int anti_idle_s);
     static void OnAntiIdleTimer(void* arg);
+    static void OnBatchTimer(void* arg);
+    int WriteNow(const butil::IOBuf& data);
+    // Writes the batched events. Requires batch_mutex_.
+    int FlushBatch();
+    int Send(const butil::IOBuf& data);
 
     UserKey key_;
     butil::intrusive_ptr<brpc::ProgressiveAttachment> writer_;
+    brpc::StreamId stream_;
     const int64_t created_us_;
     std::atomic<int64_t> written_us_;
     bthread_timer_t anti_idle_timer_id_;
     const int64_t anti_idle_us_;
     bool has_anti_idle_timer_;
+    std::atomic<bool> dead_;
+    // the last multi-room publish that has picked this session, guarded by
+    // the publish mutex of the bucket.
+    uint64_t publish_epoch_;
+    int64_t batch_window_us_;
+    size_t batch_max_bytes_;
+    // guards the batch, the timers and the destroyed flag. Events and
+    // anti-idle CRLFs are sent under it to keep their order.
+    mutable bthread::Mutex batch_mutex_;
+    bool framed_;
+    bool destroyed_;
+    butil::IOBuf batched_;
+    bthread_timer_t batch_timer_id_;
+    bool has_batch_timer_;
+    std::atomic<int> batch_error_;
     mutable bthread::Mutex mutex_;
     std::vector<RoomKey> interested_rooms_;
+    // room_slots_[i] is the position of this session in the member array of
+    // interested_rooms_[i], or npos if not joined. Each slot is guarded by
+    // the mutex of the corresponding room.
+    std::vector<size_t> room_slots_;
 };
 
 class Room : public brpc::SharedObject {
@@ -91,27 +182,86 @@ public:
     typedef butil::intrusive_ptr<Room> Ptr;
     typedef butil::FlatMap<RoomKey, Room::Ptr, RoomKey::Hasher> Map;
 
+    // A room member. `room_index' is the index of this room in the session's
+    // interested rooms, so the session's back-index can be fixed up in O(1)
+    // when members are swapped on removal.
+    struct Member {
+        Member(const Session::Ptr& session, size_t room_index)
+            : session(session), room_index(room_index) {}
+        Session::Ptr session;
+        size_t room_index;
+    };
+
+    // The members of one terminal type, so that a publish filtered by the
+    // terminal type walks only the matching members.
+    struct Partition {
+        explicit Partition(int16_t device_type)
+            : device_type(device_type), members(new std::vector<Member>) {}
+        int16_t device_type;
+        // copied on write while a publish pins it, see mutable_members.
+        std::shared_ptr<std::vector<Member> > members;
+    };
+
     ~Room();
-    void Write(const butil::IOBuf& data);
+    // Writes the members of `device_type', or all the members if it is
+    // negative. With a single-writer bucket, only the consumer of the bucket
+    // queue may call this, see Bucket::write_room. Otherwise the room lock
+    // is held only while pinning the member arrays. The lock wait and the
+    // writes are stamped on `trace' if it is not NULL.
+    void Write(const butil::IOBuf& data, int device_type = -1, PublishTrace* trace = NULL);
 
     const char* room_id() const { return key_.room_id(); }
     const RoomKey& key() const { return key_; }
+    // has_session and memory_bytes read the members under the room lock,
+    // or with the bucket queue of a single-writer room.
     bool has_session(Session::Ptr ps) const;
     size_t size() const;
+    // The bytes held by this room and its members, including its entry in
+    // the bucket.
+    size_t memory_bytes() const;
 
 protected:
-    explicit Room(const RoomKey& key);
-    void add_session(Session::Ptr ps);
-    bool del_session(Session::Ptr ps);
+    Room(const RoomKey& key, Bucket* bucket, bool single_writer);
+    void add_session(const Session::Ptr& ps, size_t room_index);
+    bool del_session(Session* session, size_t room_index);
 
 private:
+    typedef std::shared_ptr<const std::vector<Member> > Pinned;
+
+    void WriteMembers(const Member* begin, const Member* end, const butil::IOBuf& data,
+                      PublishTrace* trace) const;
+    // Returns the partition of `device_type', creating it if `create'.
+    Partition* partition(int16_t device_type, bool create);
+    const Partition* partition(int16_t device_type) const;
+    // Returns the members of `p' to change, copying them first if a publish
+    // pins them. Called with the room lock.
+    static std::vector<Member>& mutable_members(Partition* p);
+    // Pins the member arrays of `device_type', or of all the terminal types
+    // if it is negative, under the room lock, whose wait is added to
+    // `wait_us'. Returns the number of members pinned.
+    size_t pin_members(int device_type, std::vector<Pinned>* pinned, int64_t* wait_us) const;
+    // Locks mutex_, unless the room is changed and written only by the
+    // consumer of the bucket queue. The wait is recorded, and returned in
+    // `wait_us' if it is not NULL.
+    std::unique_lock<InstrumentedMutex> lock(int64_t* wait_us = NULL) const;
+    // Runs `fn' reading the members, under the room lock, or with the
+    // bucket queue if the room is single-writer. Not for the consumer of
+    // the bucket queue.
+    template <typename Fn> void read(const Fn& fn) const;
+
     RoomKey key_;
-    mutable bthread::Mutex mutex_;
-    Session::Map sessions_;
+    Bucket* const bucket_;
+    const bool single_writer_;
+    std::atomic<size_t> size_;
+    mutable InstrumentedMutex mutex_;
+    // a handful of terminal types, never removed.
+    std::vector<Partition> partitions_;
 };
 
 class Bucket : public brpc::SharedObject,
                public brpc::Describable {
+    friend class Room;
+
 public:
     typedef std::unique_ptr<Bucket> Ptr;
 
@@ -122,22 +272,130 @@ public:
     void add_session(Session::Ptr ps);
     Session::Ptr del_session(const UserKey& key);
     void update_session_rooms(const UserKey& key, const std::string& new_rooms);
+    // Marks the session dead so that fan-outs skip it, and queues it for
+    // the reaper which evicts dead sessions in batches.
+    void on_write_failed(Session* session, int err);
+    // Removes the sessions in the room `room' if it is not NULL, or else
+    // those of uid within [`min_uid', `max_uid'], in batches of
+    // -dead_session_reap_batch per exclusive access. Returns the sessions
+    // removed, which the caller should destroy.
+    std::vector<Session::Ptr> evict_sessions(const RoomKey* room,
+                                             int64_t min_uid, int64_t max_uid);
+    // Writes `data' to every member of the room, or only those of
+    // `device_type' if it is not negative.
+    // The stages are stamped on `trace' if it is not NULL.
+    void write_room(const RoomKey& key, const butil::IOBuf& data, int device_type = -1,
+                    const PublishTrace::Ptr& trace = PublishTrace::Ptr());
+    // Writes `data' once to every session in any of the rooms, filtered by
+    // `device_type' as above, and returns the number of sessions written.
+    // The bucket lock is held only while looking up the rooms, whose
+    // members are pinned as Room::Write, and the union is written in
+    // parallel chunks the same way.
+    size_t write_rooms(const std::vector<RoomKey>& room_keys, const butil::IOBuf& data,
+                       int device_type = -1,
+                       const PublishTrace::Ptr& trace = PublishTrace::Ptr());
+    // Writes `data' to every session of the bucket, or only those of
+    // `device_type' if it is not negative. The bucket lock is held only
+    // while taking the snapshot of sessions.
+    void write_all(const butil::IOBuf& data, int device_type,
+                   size_t* delivered, size_t* failed);
 
     int index() const { return index_; }
     void Describe(std::ostream& os, const brpc::DescribeOptions&) const;
     Session::Ptr get_session(const UserKey& key) const;
+    // All the online terminals of `uid'.
+    std::vector<Session::Ptr> get_user_sessions(int64_t uid) const;
     Room::Ptr get_room(const RoomKey& key) const;
     size_t count_session() const;
     size_t count_room() const;
 
+    // Where list_sessions resumes.
+    struct SessionCursor {
+        SessionCursor() : started(false) {}
+        bool started;
+        Session::Map::PositionHint hint;
+    };
+    // Appends the keys of up to `max' sessions of the bucket, or members
+    // of the room `key', from `cursor' which is then advanced. Returns
+    // false when there are no more. Each call takes the bucket once, so the
+    // sessions added or removed between the calls could be missed or
+    // listed twice.
+    bool list_sessions(SessionCursor* cursor, size_t max, std::vector<UserKey>* keys) const;
+    bool list_room_members(const RoomKey& key, size_t* cursor, size_t max,
+                           std::vector<UserKey>* keys) const;
+    // Estimates of the bytes held by the sessions and the rooms, from the
+    // counts of them and of the memberships, read without any lock.
+    int64_t session_bytes() const;
+    int64_t room_bytes() const;
+    // New sessions should be rejected, see ServerOptions. An estimate under
+    // concurrent subscribes.
+    bool is_full() const {
+        return max_sessions_ && session_count_.load(std::memory_order_relaxed) >= max_sessions_;
+    }
+    // Counts the publishes and fan-out cost of the rooms of this bucket.
+    HotRooms& hot_rooms() { return hot_rooms_; }
+    // The lock times of this bucket and its rooms.
+    LockStats& lock_stats() { return lock_stats_; }
+
 protected:
-    bool session_rooms_unchanged(const UserKey& key, const std::string& new_rooms) const;
+    // The methods below require exclusive access to the bucket.
+    Session::Ptr replace_session(const Session::Ptr& ps);
+    // Removes the session of `key', only if it is `only' when not NULL.
+    Session::Ptr remove_session(const UserKey& key, const Session* only);
+    void change_session_rooms(const UserKey& key, const std::string& new_rooms);
+    bool session_rooms_unchanged(const Session::Ptr& ps, const std::string& new_rooms) const;
+    // join or leave all the interested rooms.
+    void attach_rooms(const Session::Ptr& ps, const std::vector<RoomKey>& room_keys);
+    void detach_rooms(const Session::Ptr& ps, const std::vector<RoomKey>& room_keys);
+    // maintain the uid index of terminals.
+    void link_user(const Session::Ptr& ps);
+    void unlink_user(const Session::Ptr& ps);
 
 private:
+    struct Task {
+        std::function<void()> fn;
+        bthread::CountdownEvent* done;
+        int64_t enqueued_us;
+        int64_t* wait_us;
+    };
+
+    // Runs `fn' with exclusive access to the bucket, either under mutex_ or
+    // by the consumer of the execution queue. Waits for `fn' to finish if
+    // `wait', and returns how long `fn' waited for the access then.
+    template <typename Fn> int64_t exclusive(const Fn& fn, bool wait = true) const;
+    static int RunTasks(void* meta, bthread::TaskIterator<Task>& iter);
+    static void* RunReaper(void* arg);
+    size_t reap_dead_sessions();
+
     const int index_;
-    mutable bthread::Mutex mutex_;
+    const bool use_queue_;
+    bthread::ExecutionQueueId<Task> queue_id_;
+    LockStats lock_stats_;
+    mutable InstrumentedMutex mutex_;
     Session::Map sessions_;
     Room::Map rooms_;
+    butil::FlatMap<int64_t, std::vector<Session::Ptr> > user_sessions_;
+    // guards publish_epoch_ and those of the sessions, while write_rooms
+    // picks the union of the rooms.
+    bthread::Mutex publish_mutex_;
+    uint64_t publish_epoch_;
+
+    bthread_t reaper_tid_;
+    std::atomic<bool> stop_reaper_;
+    bthread::Mutex dead_mutex_;
+    std::vector<Session::Ptr> dead_sessions_;
+    int last_write_error_;
+    HotRooms hot_rooms_;
+    const std::function<void(const Session&)> on_session_added_;
+    const std::function<void(const Session&)> on_session_removed_;
+    const std::function<void(const Session&)> on_session_rooms_changed_;
+
+    // maintained with exclusive access, for the accounting above.
+    const size_t max_sessions_;
+    std::atomic<size_t> session_count_;
+    std::atomic<size_t> room_count_;
+    std::atomic<size_t> membership_count_;
+    std::vector<std::unique_ptr<bvar::Variable> > vars_;
 };
 
 }  // namespace sps
@@ -0,0 +1,236 @@
+#include "sps_capture.h"
+
+#include <errno.h>
+#include <string.h>
+#include <memory>
+#include <butil/logging.h>
+#include <butil/time.h>
+#include <bvar/bvar.h>
+
+
+namespace sps {
+
+const char TrafficCapture::kMagic[8] = { 'S', 'P', 'S', 'C', 'A', 'P', '0', '1' };
+
+static bvar::Adder<int64_t> g_capture_record("sps_capture_record");
+static bvar::Adder<int64_t> g_capture_dropped("sps_capture_dropped");
+
+TrafficCapture::TrafficCapture()
+    : file_(NULL)
+    , max_bytes_(0)
+    , written_bytes_(0)
+    , start_us_(0)
+    , has_queue_(false)
+    , full_(false) {
+}
+
+TrafficCapture::~TrafficCapture() {
+    Close();
+}
+
+int TrafficCapture::Open(const std::string& path, int64_t max_bytes) {
+    file_ = fopen(path.c_str(), "wb");
+    if (file_ == NULL) {
+        PLOG(ERROR) << "fail to open capture file " << path;
+        return -1;
+    }
+    if (fwrite(kMagic, sizeof(kMagic), 1, file_) != 1) {
+        PLOG(ERROR) << "fail to write capture file " << path;
+        fclose(file_);
+        file_ = NULL;
+        return -1;
+    }
+    max_bytes_ = max_bytes;
+    written_bytes_ = sizeof(kMagic);
+    start_us_ = butil::gettimeofday_us();
+    bthread::ExecutionQueueOptions queue_options;
+    if (bthread::execution_queue_start(&queue_id_, &queue_options, RunWrite, this) != 0) {
+        LOG(ERROR) << "fail to start the queue of capture";
+        fclose(file_);
+        file_ = NULL;
+        return -1;
+    }
+    has_queue_ = true;
+    LOG(INFO) << "capture traffic into " << path;
+    return 0;
+}
+
+void TrafficCapture::Close() {
+    if (has_queue_) {
+        bthread::execution_queue_stop(queue_id_);
+        bthread::execution_queue_join(queue_id_);
+        has_queue_ = false;
+    }
+    if (file_) {
+        fclose(file_);
+        file_ = NULL;
+    }
+}
+
+void TrafficCapture::Append(CaptureRecord* record) {
+    if (full_.load(std::memory_order_relaxed)) {
+        g_capture_dropped << 1;
+        delete record;
+        return;
+    }
+    record->set_offset_us(butil::gettimeofday_us() - start_us_);
+    if (bthread::execution_queue_execute(queue_id_, record) != 0) {
+        g_capture_dropped << 1;
+        delete record;
+    }
+}
+
+int TrafficCapture::RunWrite(void* meta, bthread::TaskIterator<CaptureRecord*>& iter) {
+    TrafficCapture* capture = static_cast<TrafficCapture*>(meta);
+    std::string buf;
+    std::string body;
+    for (; iter; ++iter) {
+        std::unique_ptr<CaptureRecord> record(*iter);
+        if (capture->full_.load(std::memory_order_relaxed)) {
+            g_capture_dropped << 1;
+            continue;
+        }
+        buf.clear();
+        record->SerializeToString(&body);
+        // varint length
+        uint32_t size = body.size();
+        do {
+            buf.push_back((char)((size & 0x7F) | (size > 0x7F ? 0x80 : 0)));
+            size >>= 7;
+        } while (size);
+        buf.append(body);
+        if (capture->written_bytes_ + (int64_t)buf.size() > capture->max_bytes_) {
+            capture->full_.store(true, std::memory_order_relaxed);
+            LOG(WARNING) << "capture stops at " << capture->written_bytes_ << " bytes";
+            g_capture_dropped << 1;
+            continue;
+        }
+        if (fwrite(buf.data(), buf.size(), 1, capture->file_) != 1) {
+            capture->full_.store(true, std::memory_order_relaxed);
+            PLOG(ERROR) << "fail to write capture file, capture stops";
+            continue;
+        }
+        capture->written_bytes_ += buf.size();
+        g_capture_record << 1;
+    }
+    fflush(capture->file_);
+    return 0;
+}
+
+static void fill_user(const UserKey& key, UserId* user) {
+    user->set_uid(key.uid);
+    user->set_terminal(key.device_type);
+}
+
+void TrafficCapture::OnSubscribe(const UserKey& key, const std::vector<RoomKey>& rooms) {
+    CaptureRecord* record = new CaptureRecord;
+    record->set_type(CaptureRecord::SUBSCRIBE);
+    fill_user(key, record->mutable_user());
+    for (const RoomKey& room : rooms) {
+        record->add_room_ids(room.room_id());
+    }
+    Append(record);
+}
+
+void TrafficCapture::OnUnsubscribe(const UserKey& key) {
+    CaptureRecord* record = new CaptureRecord;
+    record->set_type(CaptureRecord::UNSUBSCRIBE);
+    fill_user(key, record->mutable_user());
+    Append(record);
+}
+
+void TrafficCapture::OnRoomChange(const UserKey& key, const std::vector<RoomKey>& rooms) {
+    CaptureRecord* record = new CaptureRecord;
+    record->set_type(CaptureRecord::ROOM_CHANGE);
+    fill_user(key, record->mutable_user());
+    for (const RoomKey& room : rooms) {
+        record->add_room_ids(room.room_id());
+    }
+    Append(record);
+}
+
+void TrafficCapture::OnNotifyUser(const UserKey& key, bool all_terminals, size_t data_size) {
+    CaptureRecord* record = new CaptureRecord;
+    record->set_type(CaptureRecord::NOTIFY_USER);
+    fill_user(key, record->mutable_user());
+    if (all_terminals) {
+        record->mutable_user()->set_all_terminals(true);
+    }
+    record->set_data_size(data_size);
+    Append(record);
+}
+
+void TrafficCapture::OnNotifyRooms(const std::vector<RoomKey>& rooms, int device_type,
+                                   size_t data_size) {
+    CaptureRecord* record = new CaptureRecord;
+    record->set_type(CaptureRecord::NOTIFY_ROOM);
+    for (const RoomKey& room : rooms) {
+        record->add_room_ids(room.room_id());
+    }
+    record->set_terminal(device_type);
+    record->set_data_size(data_size);
+    Append(record);
+}
+
+void TrafficCapture::OnNotifyAll(int device_type, size_t data_size) {
+    CaptureRecord* record = new CaptureRecord;
+    record->set_type(CaptureRecord::NOTIFY_ALL);
+    record->set_terminal(device_type);
+    record->set_data_size(data_size);
+    Append(record);
+}
+
+CaptureReader::CaptureReader() : file_(NULL) {
+}
+
+CaptureReader::~CaptureReader() {
+    if (file_) {
+        fclose(file_);
+    }
+}
+
+int CaptureReader::Open(const std::string& path) {
+    file_ = fopen(path.c_str(), "rb");
+    if (file_ == NULL) {
+        PLOG(ERROR) << "fail to open capture file " << path;
+        return -1;
+    }
+    char magic[sizeof(TrafficCapture::kMagic)];
+    if (fread(magic, sizeof(magic), 1, file_) != 1
+            || memcmp(magic, TrafficCapture::kMagic, sizeof(magic)) != 0) {
+        LOG(ERROR) << path << " is not a capture file";
+        fclose(file_);
+        file_ = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+bool CaptureReader::Next(CaptureRecord* record) {
+    if (file_ == NULL) {
+        return false;
+    }
+    uint32_t size = 0;
+    for (int shift = 0; ; shift += 7) {
+        int c = fgetc(file_);
+        if (c == EOF || shift > 28) {
+            return false;
+        }
+        size |= (uint32_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            break;
+        }
+    }
+    buf_.resize(size);
+    if (size > 0 && fread(&buf_[0], size, 1, file_) != 1) {
+        LOG(WARNING) << "the capture file is truncated";
+        return false;
+    }
+    if (!record->ParseFromString(buf_)) {
+        LOG(WARNING) << "fail to parse the capture record";
+        return false;
+    }
+    return true;
+}
+
+}  // namespace sps
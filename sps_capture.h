@@ -0,0 +1,74 @@
+#ifndef SPS_CAPTURE_H_
+#define SPS_CAPTURE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <butil/iobuf.h>
+#include <bthread/execution_queue.h>
+
+#include "sps_bucket.h"
+#include "sps.pb.h"
+
+
+namespace sps {
+
+// Appends the subscribe and notify traffic to a binary log, which is
+// replayed by sps_replay. The log starts with a magic, followed by
+// records of a varint length plus a serialized CaptureRecord. Published
+// events are kept by size only.
+//
+// Records are written by the consumer of an execution queue, so that the
+// callers never wait for the disk.
+class TrafficCapture {
+public:
+    TrafficCapture();
+    ~TrafficCapture();
+
+    // Starts capturing into `path', until `max_bytes' have been written.
+    int Open(const std::string& path, int64_t max_bytes);
+    // Writes the queued records and closes the log.
+    void Close();
+
+    void OnSubscribe(const UserKey& key, const std::vector<RoomKey>& rooms);
+    void OnUnsubscribe(const UserKey& key);
+    void OnRoomChange(const UserKey& key, const std::vector<RoomKey>& rooms);
+    void OnNotifyUser(const UserKey& key, bool all_terminals, size_t data_size);
+    void OnNotifyRooms(const std::vector<RoomKey>& rooms, int device_type, size_t data_size);
+    void OnNotifyAll(int device_type, size_t data_size);
+
+    static const char kMagic[8];
+
+private:
+    void Append(CaptureRecord* record);
+    static int RunWrite(void* meta, bthread::TaskIterator<CaptureRecord*>& iter);
+
+    FILE* file_;
+    int64_t max_bytes_;
+    int64_t written_bytes_;
+    int64_t start_us_;
+    bool has_queue_;
+    bthread::ExecutionQueueId<CaptureRecord*> queue_id_;
+    std::atomic<bool> full_;
+};
+
+// Reads the records of a log written by TrafficCapture.
+class CaptureReader {
+public:
+    CaptureReader();
+    ~CaptureReader();
+
+    int Open(const std::string& path);
+    // Returns false at the end of the log or on a broken record.
+    bool Next(CaptureRecord* record);
+
+private:
+    FILE* file_;
+    std::string buf_;
+};
+
+}  // namespace sps
+
+#endif  // SPS_CAPTURE_H_
@@ -0,0 +1,259 @@
+#include "sps_hot_room.h"
+
+#include <algorithm>
+#include <gflags/gflags.h>
+#include <butil/fast_rand.h>
+#include <butil/time.h>
+
+#include "sps_bucket.h"
+
+
+DEFINE_int32(hot_room_top_k, 20, "The number of hot rooms tracked per bucket");
+DEFINE_int32(hot_room_period_s, 10, "Hot rooms are counted in periods of "
+             "these seconds, and reported for the last complete period");
+DEFINE_int32(hot_room_sketch_width, 1024, "The counters per row of the "
+             "count-min sketch, rounded up to a power of 2");
+DEFINE_int32(hot_room_sample_1_in, 16, "One in this many publishes to a room "
+             "is counted for the hot rooms, 0 disables the counting");
+
+namespace sps {
+
+static size_t round_up_power_of_2(size_t n) {
+    size_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+HotRooms::TopK::TopK(size_t k, size_t width)
+    : k_(std::max<size_t>(k, 1))
+    , mask_(round_up_power_of_2(std::max<size_t>(width, 16)) - 1)
+    , counters_(kDepth * (mask_ + 1), 0)
+    , min_(0) {
+}
+
+uint64_t HotRooms::TopK::Estimate(uint32_t hash, uint64_t value) {
+    // double hashing gives kDepth independent-enough rows.
+    const uint32_t h2 = ((hash >> 17) | (hash << 15)) | 1;
+    uint64_t estimate = UINT64_MAX;
+    for (int i = 0; i < kDepth; ++i) {
+        uint64_t& c = counters_[i * (mask_ + 1) + ((hash + i * h2) & mask_)];
+        c += value;
+        estimate = std::min(estimate, c);
+    }
+    return estimate;
+}
+
+void HotRooms::TopK::Add(const RoomKey& key, uint32_t hash, uint64_t value) {
+    const uint64_t estimate = Estimate(hash, value);
+    if (top.size() == k_ && estimate < top[min_].count) {
+        // the room can not be in top, whose count only grows.
+        return;
+    }
+    size_t i = 0;
+    for (; i < top.size(); ++i) {
+        if (top[i].room_id == key.room_id()) {
+            top[i].count = estimate;
+            break;
+        }
+    }
+    if (i == top.size()) {
+        Entry e;
+        e.room_id = key.room_id();
+        e.count = estimate;
+        if (top.size() < k_) {
+            top.push_back(e);
+        } else {
+            top[min_] = e;
+        }
+    }
+    min_ = 0;
+    for (size_t j = 1; j < top.size(); ++j) {
+        if (top[j].count < top[min_].count) {
+            min_ = j;
+        }
+    }
+}
+
+void HotRooms::TopK::Clear() {
+    top.clear();
+    std::fill(counters_.begin(), counters_.end(), 0);
+    min_ = 0;
+}
+
+HotRooms::HotRooms()
+    : period_us_(std::max(FLAGS_hot_room_period_s, 1) * 1000000L)
+    , period_start_us_(butil::gettimeofday_us())
+    , publish_(FLAGS_hot_room_top_k, FLAGS_hot_room_sketch_width)
+    , cost_(FLAGS_hot_room_top_k, FLAGS_hot_room_sketch_width) {
+}
+
+HotRooms::~HotRooms() {
+}
+
+void HotRooms::Update(const RoomKey& key, size_t members, size_t bytes) {
+    // most publishes leave without the lock or the clock.
+    const int sample_1_in = FLAGS_hot_room_sample_1_in;
+    if (sample_1_in <= 0 || butil::fast_rand_less_than(sample_1_in) != 0) {
+        return;
+    }
+    const uint32_t hash = RoomKey::Hasher()(key);
+    const int64_t now_us = butil::gettimeofday_us();
+    BAIDU_SCOPED_LOCK(mutex_);
+    RotateIfNeeded(now_us);
+    // scaled up to estimate all the publishes.
+    publish_.Add(key, hash, sample_1_in);
+    cost_.Add(key, hash, (uint64_t)members * bytes * sample_1_in);
+}
+
+static bool more_publish(const HotRoom& a, const HotRoom& b) {
+    return a.publish_per_second > b.publish_per_second;
+}
+
+static bool more_cost(const HotRoom& a, const HotRoom& b) {
+    return a.cost_per_second > b.cost_per_second;
+}
+
+void HotRooms::RotateIfNeeded(int64_t now_us) {
+    const int64_t elapsed_us = now_us - period_start_us_;
+    if (elapsed_us < period_us_) {
+        return;
+    }
+    last_by_publish_.clear();
+    last_by_cost_.clear();
+    // nothing was counted in the last complete period if it is too late.
+    if (elapsed_us < period_us_ * 2) {
+        // the period ends at the first update or read after it is due, so
+        // the counts cover all the time elapsed.
+        const double seconds = elapsed_us / 1000000.0;
+        for (const TopK::Entry& e : publish_.top) {
+            HotRoom r = { e.room_id, e.count / seconds, 0 };
+            last_by_publish_.push_back(r);
+        }
+        for (const TopK::Entry& e : cost_.top) {
+            HotRoom r = { e.room_id, 0, e.count / seconds };
+            last_by_cost_.push_back(r);
+        }
+        // fill in the other metric where the room is hot in both ways.
+        for (HotRoom& p : last_by_publish_) {
+            for (const HotRoom& c : last_by_cost_) {
+                if (p.room_id == c.room_id) {
+                    p.cost_per_second = c.cost_per_second;
+                    break;
+                }
+            }
+        }
+        for (HotRoom& c : last_by_cost_) {
+            for (const HotRoom& p : last_by_publish_) {
+                if (c.room_id == p.room_id) {
+                    c.publish_per_second = p.publish_per_second;
+                    break;
+                }
+            }
+        }
+        std::sort(last_by_publish_.begin(), last_by_publish_.end(), more_publish);
+        std::sort(last_by_cost_.begin(), last_by_cost_.end(), more_cost);
+    }
+    publish_.Clear();
+    cost_.Clear();
+    period_start_us_ = now_us;
+}
+
+void HotRooms::GetHotRooms(std::vector<HotRoom>* by_publish, std::vector<HotRoom>* by_cost) {
+    BAIDU_SCOPED_LOCK(mutex_);
+    RotateIfNeeded(butil::gettimeofday_us());
+    if (by_publish) {
+        *by_publish = last_by_publish_;
+    }
+    if (by_cost) {
+        *by_cost = last_by_cost_;
+    }
+}
+
+void HotRooms::Merge(std::vector<HotRoom>* rooms, bool by_cost, size_t k) {
+    // a room could be hot in several buckets. every bucket counts the same
+    // publish once, while the cost is split by the members of each bucket.
+    std::sort(rooms->begin(), rooms->end(),
+              [](const HotRoom& a, const HotRoom& b) { return a.room_id < b.room_id; });
+    std::vector<HotRoom> merged;
+    for (const HotRoom& r : *rooms) {
+        if (!merged.empty() && merged.back().room_id == r.room_id) {
+            merged.back().publish_per_second = std::max(merged.back().publish_per_second,
+                                                        r.publish_per_second);
+            merged.back().cost_per_second += r.cost_per_second;
+        } else {
+            merged.push_back(r);
+        }
+    }
+    std::sort(merged.begin(), merged.end(), by_cost ? more_cost : more_publish);
+    if (merged.size() > k) {
+        merged.resize(k);
+    }
+    rooms->swap(merged);
+}
+
+LockedRooms::LockedRooms()
+    : period_us_(std::max(FLAGS_hot_room_period_s, 1) * 1000000L)
+    , period_start_us_(butil::gettimeofday_us())
+    , lock_(FLAGS_hot_room_top_k, FLAGS_hot_room_sketch_width) {
+}
+
+void LockedRooms::Update(const RoomKey& key, int64_t lock_us) {
+    const uint32_t hash = RoomKey::Hasher()(key);
+    const int64_t now_us = butil::gettimeofday_us();
+    BAIDU_SCOPED_LOCK(mutex_);
+    RotateIfNeeded(now_us);
+    lock_.Add(key, hash, std::max<int64_t>(lock_us, 0));
+}
+
+static bool more_lock(const LockedRoom& a, const LockedRoom& b) {
+    return a.lock_us_per_second > b.lock_us_per_second;
+}
+
+void LockedRooms::RotateIfNeeded(int64_t now_us) {
+    const int64_t elapsed_us = now_us - period_start_us_;
+    if (elapsed_us < period_us_) {
+        return;
+    }
+    last_.clear();
+    if (elapsed_us < period_us_ * 2) {
+        // as HotRooms, the counts cover all the time elapsed.
+        const double seconds = elapsed_us / 1000000.0;
+        for (const HotRooms::TopK::Entry& e : lock_.top) {
+            LockedRoom r = { e.room_id, e.count / seconds };
+            last_.push_back(r);
+        }
+        std::sort(last_.begin(), last_.end(), more_lock);
+    }
+    lock_.Clear();
+    period_start_us_ = now_us;
+}
+
+void LockedRooms::GetLockedRooms(std::vector<LockedRoom>* rooms) {
+    BAIDU_SCOPED_LOCK(mutex_);
+    RotateIfNeeded(butil::gettimeofday_us());
+    *rooms = last_;
+}
+
+void LockedRooms::Merge(std::vector<LockedRoom>* rooms, size_t k) {
+    // a room of several buckets has a lock in each; the worst one is kept.
+    std::sort(rooms->begin(), rooms->end(),
+              [](const LockedRoom& a, const LockedRoom& b) { return a.room_id < b.room_id; });
+    std::vector<LockedRoom> merged;
+    for (const LockedRoom& r : *rooms) {
+        if (!merged.empty() && merged.back().room_id == r.room_id) {
+            merged.back().lock_us_per_second = std::max(merged.back().lock_us_per_second,
+                                                         r.lock_us_per_second);
+        } else {
+            merged.push_back(r);
+        }
+    }
+    std::sort(merged.begin(), merged.end(), more_lock);
+    if (merged.size() > k) {
+        merged.resize(k);
+    }
+    rooms->swap(merged);
+}
+
+}  // namespace sps
@@ -0,0 +1,103 @@
+#ifndef SPS_HOT_ROOM_H_
+#define SPS_HOT_ROOM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <bthread/mutex.h>
+
+
+namespace sps {
+
+struct RoomKey;
+
+struct HotRoom {
+    std::string room_id;
+    double publish_per_second;
+    // bytes x members delivered per second
+    double cost_per_second;
+};
+
+// Finds the rooms publishing most, by count and by fan-out cost, with a
+// count-min sketch plus a small top-K list for each. Counting happens in
+// periods; the hot rooms reported are those of the last complete period.
+class HotRooms {
+public:
+    HotRooms();
+    ~HotRooms();
+
+    // Counts a publish of `bytes' to `members', one in
+    // -hot_room_sample_1_in of the calls.
+    void Update(const RoomKey& key, size_t members, size_t bytes);
+    void GetHotRooms(std::vector<HotRoom>* by_publish, std::vector<HotRoom>* by_cost);
+
+    // Merges the hot rooms of several buckets and keeps the top `k'.
+    static void Merge(std::vector<HotRoom>* rooms, bool by_cost, size_t k);
+
+    // The keys adding the most value, by a count-min sketch of `width'.
+    class TopK {
+    public:
+        TopK(size_t k, size_t width);
+        void Add(const RoomKey& key, uint32_t hash, uint64_t value);
+        void Clear();
+
+        struct Entry {
+            std::string room_id;
+            uint64_t count;
+        };
+        std::vector<Entry> top;
+
+    private:
+        static const int kDepth = 4;
+        uint64_t Estimate(uint32_t hash, uint64_t value);
+
+        const size_t k_;
+        const size_t mask_;
+        std::vector<uint64_t> counters_;  // kDepth rows of width
+        size_t min_;  // index of the least entry in top
+    };
+
+private:
+    void RotateIfNeeded(int64_t now_us);
+
+    bthread::Mutex mutex_;
+    const int64_t period_us_;
+    int64_t period_start_us_;
+    TopK publish_;
+    TopK cost_;
+    std::vector<HotRoom> last_by_publish_;
+    std::vector<HotRoom> last_by_cost_;
+};
+
+struct LockedRoom {
+    std::string room_id;
+    // microseconds per second the room lock is waited for or held
+    double lock_us_per_second;
+};
+
+// Finds the rooms whose locks are waited for and held the longest, from
+// the sampled acquisitions, counted in periods as HotRooms.
+class LockedRooms {
+public:
+    LockedRooms();
+
+    void Update(const RoomKey& key, int64_t lock_us);
+    void GetLockedRooms(std::vector<LockedRoom>* rooms);
+
+    // Merges the locked rooms of several buckets and keeps the top `k'.
+    static void Merge(std::vector<LockedRoom>* rooms, size_t k);
+
+private:
+    void RotateIfNeeded(int64_t now_us);
+
+    bthread::Mutex mutex_;
+    const int64_t period_us_;
+    int64_t period_start_us_;
+    HotRooms::TopK lock_;
+    std::vector<LockedRoom> last_;
+};
+
+}  // namespace sps
+
+#endif  // SPS_HOT_ROOM_H_
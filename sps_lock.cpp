@@ -0,0 +1,69 @@
+#include "sps_lock.h"
+
+#include <gflags/gflags.h>
+#include <butil/fast_rand.h>
+#include <butil/string_printf.h>
+#include <butil/time.h>
+
+#include "sps_bucket.h"
+
+
+DEFINE_int32(room_lock_sample_1_in, 64, "One in this many room lock "
+             "acquisitions is attributed to its room, see /show_hot_rooms?by=lock. "
+             "0 disables the attribution");
+
+namespace sps {
+
+LockStats::LockStats(int bucket_index)
+    : bucket_wait(butil::string_printf("sps_bucket_%d_lock_wait", bucket_index))
+    , bucket_hold(butil::string_printf("sps_bucket_%d_lock_hold", bucket_index))
+    , room_wait(butil::string_printf("sps_bucket_%d_room_lock_wait", bucket_index))
+    , room_hold(butil::string_printf("sps_bucket_%d_room_lock_hold", bucket_index)) {
+}
+
+InstrumentedMutex::InstrumentedMutex(LockStats* stats, const RoomKey* room)
+    : stats_(stats)
+    , room_(room)
+    , locked_us_(0)
+    , wait_us_(0) {
+}
+
+void InstrumentedMutex::lock() {
+    const int64_t start_us = butil::cpuwide_time_us();
+    mutex_.lock();
+    locked_us_ = butil::cpuwide_time_us();
+    wait_us_ = locked_us_ - start_us;
+    if (stats_) {
+        (room_ ? stats_->room_wait : stats_->bucket_wait) << wait_us_;
+    }
+}
+
+bool InstrumentedMutex::try_lock() {
+    if (!mutex_.try_lock()) {
+        return false;
+    }
+    locked_us_ = butil::cpuwide_time_us();
+    wait_us_ = 0;
+    return true;
+}
+
+void InstrumentedMutex::unlock() {
+    const int64_t hold_us = butil::cpuwide_time_us() - locked_us_;
+    const int64_t wait_us = wait_us_;
+    mutex_.unlock();
+    if (stats_ == NULL) {
+        return;
+    }
+    if (room_ == NULL) {
+        stats_->bucket_hold << hold_us;
+        return;
+    }
+    stats_->room_hold << hold_us;
+    const int sample_1_in = FLAGS_room_lock_sample_1_in;
+    if (sample_1_in > 0 && butil::fast_rand_less_than(sample_1_in) == 0) {
+        // scaled up to estimate all the acquisitions.
+        stats_->locked_rooms.Update(*room_, (wait_us + hold_us) * sample_1_in);
+    }
+}
+
+}  // namespace sps
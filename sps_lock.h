@@ -0,0 +1,57 @@
+#ifndef SPS_LOCK_H_
+#define SPS_LOCK_H_
+
+#include <stdint.h>
+#include <bthread/mutex.h>
+#include <bvar/bvar.h>
+
+#include "sps_hot_room.h"
+
+
+namespace sps {
+
+struct RoomKey;
+
+// The lock times of a bucket and of its rooms, exported as
+//   sps_bucket_<index>_lock_wait       waits for the bucket lock
+//   sps_bucket_<index>_lock_hold       holds of the bucket lock
+//   sps_bucket_<index>_room_lock_wait  waits for any room lock
+//   sps_bucket_<index>_room_lock_hold  holds of any room lock
+// and the rooms locked the longest, from one in -room_lock_sample_1_in
+// room lock acquisitions.
+struct LockStats {
+    explicit LockStats(int bucket_index);
+
+    bvar::LatencyRecorder bucket_wait;
+    bvar::LatencyRecorder bucket_hold;
+    bvar::LatencyRecorder room_wait;
+    bvar::LatencyRecorder room_hold;
+    LockedRooms locked_rooms;
+};
+
+// A bthread::Mutex recording how long it is waited for and held into the
+// bucket lock of `stats', or into the room locks if `room' is not NULL.
+// Nothing is recorded with NULL `stats'. Being a bthread::Mutex inside, its
+// contention is sampled by the /contention profiler of brpc as well.
+class InstrumentedMutex {
+public:
+    explicit InstrumentedMutex(LockStats* stats, const RoomKey* room = NULL);
+
+    void lock();
+    void unlock();
+    bool try_lock();
+    // The wait of the current acquisition, read only by the holder.
+    int64_t wait_us() const { return wait_us_; }
+
+private:
+    bthread::Mutex mutex_;
+    LockStats* const stats_;
+    const RoomKey* const room_;
+    // guarded by mutex_
+    int64_t locked_us_;
+    int64_t wait_us_;
+};
+
+}  // namespace sps
+
+#endif  // SPS_LOCK_H_
@@ -0,0 +1,246 @@
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <gflags/gflags.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+#include <butil/strings/string_number_conversions.h>
+#include <butil/containers/flat_map.h>
+#include <bthread/bthread.h>
+#include <bvar/bvar.h>
+#include <brpc/channel.h>
+#include <brpc/progressive_reader.h>
+
+#include "sps_capture.h"
+#include "sps.pb.h"
+
+
+DEFINE_string(server, "127.0.0.1:8080", "IP Address of sps");
+DEFINE_string(capture_file, "sps.capture", "The traffic captured by sps -capture_file");
+DEFINE_double(speed, 1, "Replay at this times the captured speed. 0 replays "
+              "as fast as possible");
+DEFINE_int32(timeout_ms, 1000, "RPC timeout in milliseconds");
+DEFINE_int32(anti_idle_s, 1, "Anti-idle seconds of the simulated subscribers, "
+             "which bounds how long an unsubscribe takes to close the Wire");
+
+// publish: from sending the notify to its response.
+bvar::LatencyRecorder g_publish_latency("sps_replay_publish");
+// delivery: from sending the notify to a subscriber reading the event.
+bvar::LatencyRecorder g_delivery_latency("sps_replay_delivery");
+bvar::Adder<int64_t> g_error_count("sps_replay_error");
+bvar::Adder<int64_t> g_online_count("sps_replay_online");
+
+// Every event replayed is `#<send_us>#' padded to the captured size with
+// `x' and ended by `\n'. A subscriber scans its Wire for the stamps.
+static std::string make_event(size_t size) {
+    std::string event = "#" + butil::Int64ToString(butil::gettimeofday_us()) + "#";
+    if (event.size() + 1 < size) {
+        event.append(size - event.size() - 1, 'x');
+    }
+    event.push_back('\n');
+    return event;
+}
+
+class Subscriber : public brpc::ProgressiveReader {
+public:
+    explicit Subscriber(const std::shared_ptr<std::atomic<bool> >& stop)
+        : stop_(stop), in_stamp_(false), stamp_(0) {
+        g_online_count << 1;
+    }
+
+    butil::Status OnReadOnePart(const void* data, size_t length) override {
+        if (*stop_) {
+            // closes the Wire, see the anti-idle seconds
+            return butil::Status(ECANCELED, "unsubscribed");
+        }
+        const char* p = static_cast<const char*>(data);
+        for (size_t i = 0; i < length; ++i) {
+            if (p[i] == '#') {
+                if (in_stamp_) {
+                    g_delivery_latency << butil::gettimeofday_us() - stamp_;
+                }
+                in_stamp_ = !in_stamp_;
+                stamp_ = 0;
+            } else if (in_stamp_) {
+                stamp_ = stamp_ * 10 + (p[i] - '0');
+            }
+        }
+        return butil::Status::OK();
+    }
+
+    void OnEndOfMessage(const butil::Status& status) override {
+        g_online_count << -1;
+        delete this;
+    }
+
+private:
+    std::shared_ptr<std::atomic<bool> > stop_;
+    bool in_stamp_;
+    int64_t stamp_;
+};
+
+struct Replayer {
+    brpc::Channel channel;
+    // the unsubscribe switches of the online subscribers
+    butil::FlatMap<int64_t, std::shared_ptr<std::atomic<bool> > > subscribers;
+};
+
+static int64_t subscriber_id(const sps::UserId& user) {
+    return (user.uid() << 16) ^ (user.terminal() & 0xFFFF);
+}
+
+static std::string join_rooms(const sps::CaptureRecord& record) {
+    std::string rooms;
+    for (int i = 0; i < record.room_ids_size(); ++i) {
+        rooms.append(i ? "," : "").append(record.room_ids(i));
+    }
+    return rooms;
+}
+
+static void unsubscribe(Replayer* r, const sps::UserId& user) {
+    std::shared_ptr<std::atomic<bool> >* pstop = r->subscribers.seek(subscriber_id(user));
+    if (pstop) {
+        **pstop = true;
+        r->subscribers.erase(subscriber_id(user));
+    }
+}
+
+static void subscribe(Replayer* r, const sps::CaptureRecord& record) {
+    const sps::UserId& user = record.user();
+    unsubscribe(r, user);  // replaced by the new Wire
+    brpc::Controller cntl;
+    std::string url = "/PushService/subscribe?u=" + butil::Int64ToString(user.uid())
+            + "&t=" + butil::IntToString(user.terminal())
+            + "&i=" + butil::IntToString(FLAGS_anti_idle_s);
+    if (record.room_ids_size() > 0) {
+        url += "&r=" + join_rooms(record);
+    }
+    cntl.http_request().uri() = url;
+    cntl.response_will_be_read_progressively();
+    r->channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    if (cntl.Failed()) {
+        g_error_count << 1;
+        LOG_EVERY_SECOND(WARNING) << "fail to subscribe: " << cntl.ErrorText();
+        return;
+    }
+    std::shared_ptr<std::atomic<bool> > stop(new std::atomic<bool>(false));
+    r->subscribers[subscriber_id(user)] = stop;
+    cntl.ReadProgressiveAttachmentBy(new Subscriber(stop));
+}
+
+static void handle_notify_response(brpc::Controller* cntl) {
+    std::unique_ptr<brpc::Controller> cntl_guard(cntl);
+    if (cntl->Failed()) {
+        g_error_count << 1;
+        LOG_EVERY_SECOND(WARNING) << "fail to notify: " << cntl->ErrorText();
+        return;
+    }
+    g_publish_latency << cntl->latency_us();
+}
+
+static void notify(Replayer* r, const sps::CaptureRecord& record) {
+    std::string url;
+    switch (record.type()) {
+    case sps::CaptureRecord::NOTIFY_USER:
+        url = "/PushService/notify_to_user?u=" + butil::Int64ToString(record.user().uid())
+                + "&t=" + (record.user().all_terminals()
+                           ? std::string("all") : butil::IntToString(record.user().terminal()));
+        break;
+    case sps::CaptureRecord::NOTIFY_ROOM:
+        url = "/PushService/notify_to_room?r=" + join_rooms(record);
+        if (record.terminal() >= 0) {
+            url += "&t=" + butil::IntToString(record.terminal());
+        }
+        break;
+    default:
+        url = "/PushService/notify_all";
+        if (record.terminal() >= 0) {
+            url += "?t=" + butil::IntToString(record.terminal());
+        }
+        break;
+    }
+    brpc::Controller* cntl = new brpc::Controller;
+    cntl->http_request().uri() = url;
+    cntl->http_request().set_method(brpc::HTTP_METHOD_POST);
+    cntl->request_attachment().append(make_event(record.data_size()));
+    r->channel.CallMethod(NULL, cntl, NULL, NULL,
+                          brpc::NewCallback(handle_notify_response, cntl));
+}
+
+int main(int argc, char* argv[]) {
+    GFLAGS_NS::SetUsageMessage("Replay the traffic captured by sps against a local sps");
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+
+    sps::CaptureReader reader;
+    if (reader.Open(FLAGS_capture_file) != 0) {
+        return -1;
+    }
+    Replayer r;
+    if (r.subscribers.init(1024) != 0) {
+        LOG(ERROR) << "Fail to init subscribers";
+        return -1;
+    }
+    brpc::ChannelOptions options;
+    options.timeout_ms = FLAGS_timeout_ms;
+    options.protocol = brpc::PROTOCOL_HTTP;
+    if (r.channel.Init(FLAGS_server.c_str(), &options) != 0) {
+        LOG(ERROR) << "Fail to initialize http channel";
+        return -1;
+    }
+
+    const int64_t start_us = butil::gettimeofday_us();
+    int64_t report_us = start_us;
+    int64_t records = 0;
+    sps::CaptureRecord record;
+    while (reader.Next(&record)) {
+        if (FLAGS_speed > 0) {
+            int64_t due_us = start_us + (int64_t)(record.offset_us() / FLAGS_speed);
+            int64_t now_us = butil::gettimeofday_us();
+            if (due_us > now_us) {
+                bthread_usleep(due_us - now_us);
+            }
+        }
+        switch (record.type()) {
+        case sps::CaptureRecord::SUBSCRIBE:
+        case sps::CaptureRecord::ROOM_CHANGE:
+            // sps has no API changing the rooms of a Wire, so a change is
+            // replayed by a subscribe replacing the Wire.
+            subscribe(&r, record);
+            break;
+        case sps::CaptureRecord::UNSUBSCRIBE:
+            unsubscribe(&r, record.user());
+            break;
+        default:
+            notify(&r, record);
+            break;
+        }
+        ++records;
+        if (butil::gettimeofday_us() - report_us >= 1000000) {
+            report_us = butil::gettimeofday_us();
+            LOG(INFO) << "records=" << records
+                      << " online=" << g_online_count.get_value()
+                      << " publish_qps=" << g_publish_latency.qps(1)
+                      << " publish_latency=" << g_publish_latency.latency(1)
+                      << " delivery_qps=" << g_delivery_latency.qps(1)
+                      << " delivery_latency=" << g_delivery_latency.latency(1)
+                      << " error=" << g_error_count.get_value();
+        }
+    }
+
+    // wait for the last events to arrive.
+    sleep(1);
+    const double elapsed_s = std::max(butil::gettimeofday_us() - start_us, (int64_t)1) / 1000000.0;
+    LOG(INFO) << "replayed records=" << records
+              << " in " << elapsed_s << "s"
+              << " publish_count=" << g_publish_latency.count()
+              << " publish_p99_latency=" << g_publish_latency.latency_percentile(0.99)
+              << " delivery_count=" << g_delivery_latency.count()
+              << " delivery_qps=" << g_delivery_latency.count() / elapsed_s
+              << " delivery_p99_latency=" << g_delivery_latency.latency_percentile(0.99)
+              << " error=" << g_error_count.get_value();
+    for (butil::FlatMap<int64_t, std::shared_ptr<std::atomic<bool> > >::iterator it = r.subscribers.begin();
+            it != r.subscribers.end(); ++it) {
+        *it->second = true;
+    }
+    return 0;
+}
@@ -2,23 +2,87 @@
 
 #include <gflags/gflags.h>
 #include <butil/logging.h>
+#include <butil/fast_rand.h>
 #include <butil/strings/string_number_conversions.h>
 #include <butil/strings/string_split.h>
+#include <butil/time.h>
+#include <bthread/bthread.h>
+#include <bvar/bvar.h>
 #include <brpc/server.h>
+#include <brpc/stream.h>
 
+#include "sps_auth.h"
 #include "sps_bucket.h"
+#include "sps_capture.h"
 #include "sps.pb.h"
 
 
 DEFINE_int32(port, 8080, "TCP Port of this server");
 DEFINE_int32(idle_timeout_s, -1, "Connection will be closed if there is no "
              "read/write operations during the last `idle_timeout_s'");
-DEFINE_string(certificate, "insecure.crt", "Certificate file path to enable SSL");
+DEFINE_int32(batch_window_us, 0, "Events written to a framed Wire within this "
+             "window are coalesced into one write, if its subscriber gives a "
+             "negative `b'. Non-positive value disables batching");
+DEFINE_int32(batch_max_bytes, 16384, "A coalesced write is issued as soon as "
+             "it reaches this size");
+DEFINE_string(jwt_secret, "", "HMAC secret of the HS256 token which subscribers "
+              "must present in `Authorization: Bearer <token>'. Empty value "
+              "disables authentication");
+DEFINE_string(jwt_uid_claim, "uid", "The token claim that must equal `u'");
+DEFINE_int32(jwt_cache_capacity, 1000000, "The number of verified tokens remembered");
+DEFINE_bool(bucket_execution_queue, false, "Operate each bucket by the single "
+            "consumer of its execution queue instead of locks");
+DEFINE_int32(publish_stream_batch, 128, "The max number of messages a publish "
+             "stream hands to PublishService at once");
+DEFINE_string(capture_file, "", "Append the subscribe and publish traffic to "
+              "this file for sps_replay. Empty value disables capturing");
+DEFINE_int32(capture_max_mb, 1024, "Capturing stops when the file reaches this size");
+DEFINE_int32(max_rooms_per_session, 0, "Subscribes with more rooms than this "
+             "are rejected, 0 for no limit");
+DEFINE_int32(max_terminal_type, 255, "Subscribes with a terminal type `t' "
+             "out of [0, this] are rejected");
+DEFINE_int32(max_sessions_per_bucket, 0, "Subscribes are rejected when the "
+             "bucket has this many sessions, 0 for no limit");
+DEFINE_int64(wire_stream_max_buf_size, 2 * 1024 * 1024, "A Wire opened by "
+             "SubscribeService fails to write, and is reaped, when its subscriber "
+             "has this many bytes unconsumed");
+DEFINE_int32(export_batch, 1000, "/export_members takes the bucket once per "
+             "this many sessions");
+DEFINE_int32(export_stall_timeout_ms, 30000, "/export_members is aborted when "
+             "its reader takes nothing for this long");
+DEFINE_string(certificate, "insecure.crt", "Certificate file path to enable SSL, "
+              "RSA or ECDSA");
 DEFINE_string(private_key, "insecure.key", "Private key file path to enable SSL");
+DEFINE_string(ssl_ciphers, "", "OpenSSL cipher list of TLS Wires, empty takes the "
+              "default of brpc");
+DEFINE_string(ssl_ecdhe_curve, "prime256v1", "The curve of ECDHE key exchanges");
+DEFINE_int32(ssl_session_lifetime_s, 3600, "Seconds a cached TLS session can be resumed");
 
 namespace sps {
 
 static SimplePushServer* SPS = nullptr;
+static TrafficCapture* CAPTURE = nullptr;
+
+// Captured as the sessions join and leave the buckets, so that a replaced
+// session is captured leaving before its successor joins, and the reaped
+// and evicted ones are captured as well.
+static void capture_subscribe(const Session& session) {
+    if (CAPTURE) {
+        CAPTURE->OnSubscribe(session.key(), session.interested_rooms());
+    }
+}
+
+static void capture_unsubscribe(const Session& session) {
+    if (CAPTURE) {
+        CAPTURE->OnUnsubscribe(session.key());
+    }
+}
+
+static void capture_room_change(const Session& session) {
+    if (CAPTURE) {
+        CAPTURE->OnRoomChange(session.key(), session.interested_rooms());
+    }
+}
 
 SimplePushServer::SimplePushServer(const ServerOptions& options)
     : brpc_server_(new brpc::Server)
@@ -26,6 +90,10 @@ SimplePushServer::SimplePushServer(const ServerOptions& options)
     for (size_t i = 0; i < options.bucket_size; ++i) {
         buckets_[i].reset(new Bucket(i, options));
     }
+    if (!FLAGS_jwt_secret.empty()) {
+        token_verifier_.reset(new TokenVerifier(FLAGS_jwt_secret, FLAGS_jwt_uid_claim,
+                                                FLAGS_jwt_cache_capacity));
+    }
 }
 
 void remove_from_bucket(Bucket& bucket, UserKey key, void* cid) {
@@ -52,6 +120,194 @@ void remove_from_bucket(Bucket& bucket, UserKey key, void* cid) {
     VLOG(1);
 }
 
+// The hottest rooms of the last period across all buckets.
+static std::vector<HotRoom> collect_hot_rooms(bool by_cost, size_t k) {
+    std::vector<HotRoom> rooms;
+    if (SPS == nullptr) {
+        return rooms;
+    }
+    for (Bucket::Ptr& pb : SPS->buckets()) {
+        std::vector<HotRoom> hot;
+        if (by_cost) {
+            pb->hot_rooms().GetHotRooms(NULL, &hot);
+        } else {
+            pb->hot_rooms().GetHotRooms(&hot, NULL);
+        }
+        rooms.insert(rooms.end(), hot.begin(), hot.end());
+    }
+    HotRooms::Merge(&rooms, by_cost, k);
+    return rooms;
+}
+
+static void print_hot_rooms(std::ostream& os, void* by_cost) {
+    std::vector<HotRoom> rooms = collect_hot_rooms(by_cost != NULL, 10);
+    for (size_t i = 0; i < rooms.size(); ++i) {
+        os << (i ? " " : "") << rooms[i].room_id << ":"
+           << (by_cost ? rooms[i].cost_per_second : rooms[i].publish_per_second);
+    }
+}
+
+static bvar::PassiveStatus<std::string> g_hot_rooms_by_publish(
+    "sps_hot_rooms_by_publish", print_hot_rooms, NULL);
+static bvar::PassiveStatus<std::string> g_hot_rooms_by_cost(
+    "sps_hot_rooms_by_cost", print_hot_rooms, (void*)1);
+
+// The rooms locked the longest in the last period across all buckets.
+static std::vector<LockedRoom> collect_locked_rooms(size_t k) {
+    std::vector<LockedRoom> rooms;
+    if (SPS == nullptr) {
+        return rooms;
+    }
+    for (Bucket::Ptr& pb : SPS->buckets()) {
+        std::vector<LockedRoom> locked;
+        pb->lock_stats().locked_rooms.GetLockedRooms(&locked);
+        rooms.insert(rooms.end(), locked.begin(), locked.end());
+    }
+    LockedRooms::Merge(&rooms, k);
+    return rooms;
+}
+
+static void print_locked_rooms(std::ostream& os, void*) {
+    std::vector<LockedRoom> rooms = collect_locked_rooms(10);
+    for (size_t i = 0; i < rooms.size(); ++i) {
+        os << (i ? " " : "") << rooms[i].room_id << ":" << rooms[i].lock_us_per_second;
+    }
+}
+
+static bvar::PassiveStatus<std::string> g_hot_rooms_by_lock(
+    "sps_hot_rooms_by_lock", print_locked_rooms, NULL);
+
+// Writes `data' to the session, and hands the session to the reaper on
+// failure.
+static int write_to_session(Bucket& bucket, const Session::Ptr& ps, const butil::IOBuf& data,
+                            PublishTrace* trace = NULL) {
+    int err = ps->Write(data);
+    if (err) {
+        bucket.on_write_failed(ps.get(), err);
+    } else if (trace) {
+        const int64_t now_us = butil::cpuwide_time_us();
+        trace->AddWrites(now_us, now_us);
+    }
+    return err;
+}
+
+// A session evicted by /disconnect, closed when its timer fires.
+struct ClosingSession {
+    Session::Ptr ps;
+    butil::IOBuf last_event;
+};
+
+// Writes the last event, if any, and closes the Wire as the last
+// reference to the session is released.
+static void close_session(void* arg) {
+    std::unique_ptr<ClosingSession> c(static_cast<ClosingSession*>(arg));
+    if (!c->last_event.empty()) {
+        c->ps->set_batch(0, 0);  // written right now
+        c->ps->Write(c->last_event);
+    }
+    c->ps->Destroy();
+}
+
+// Closes the sessions at random moments within `spread_us', so that their
+// Clients do not reconnect all at once.
+static void close_sessions(const std::vector<Session::Ptr>& sessions,
+                           const butil::IOBuf& last_event, int64_t spread_us) {
+    const int64_t now_us = butil::gettimeofday_us();
+    for (const Session::Ptr& ps : sessions) {
+        ClosingSession* c = new ClosingSession;
+        c->ps = ps;
+        c->last_event = last_event;
+        bthread_timer_t timer_id;
+        if (spread_us <= 0 || bthread_timer_add(&timer_id,
+                butil::microseconds_to_timespec(now_us + butil::fast_rand_less_than(spread_us)),
+                close_session, c) != 0) {
+            close_session(c);
+        }
+    }
+}
+
+struct ExportArgs {
+    butil::intrusive_ptr<brpc::ProgressiveAttachment> pa;
+    std::unique_ptr<RoomKey> room;  // all the sessions if NULL
+    int bucket;                     // all the buckets if negative
+};
+
+// Writes the keys in batches, waiting while the reader falls behind, for
+// -export_stall_timeout_ms at most.
+static bool write_keys(brpc::ProgressiveAttachment* pa, const std::vector<UserKey>& keys) {
+    if (keys.empty()) {
+        return true;
+    }
+    butil::IOBufBuilder os;
+    for (const UserKey& key : keys) {
+        os << key.uid << " " << key.device_type << "\n";
+    }
+    butil::IOBuf data;
+    os.move_to(data);
+    const int64_t deadline_us = butil::gettimeofday_us()
+        + std::max(FLAGS_export_stall_timeout_ms, 0) * 1000L;
+    while (pa->Write(data) != 0) {
+        if (errno != brpc::EOVERCROWDED) {
+            LOG(WARNING) << "stop exporting members: " << berror(errno);
+            return false;
+        }
+        if (butil::gettimeofday_us() >= deadline_us) {
+            LOG(WARNING) << "stop exporting members: the reader has taken nothing for "
+                         << FLAGS_export_stall_timeout_ms << "ms";
+            return false;
+        }
+        bthread_usleep(10000);
+    }
+    return true;
+}
+
+// Streams the members of a room, or the sessions, bucket by bucket, so
+// that no bucket is taken for longer than -export_batch sessions.
+static void* run_export(void* arg) {
+    std::unique_ptr<ExportArgs> a(static_cast<ExportArgs*>(arg));
+    const size_t batch = std::max(FLAGS_export_batch, 1);
+    std::vector<UserKey> keys;
+    for (Bucket::Ptr& pb : SPS->buckets()) {
+        if (a->bucket >= 0 && pb->index() != a->bucket) {
+            continue;
+        }
+        Bucket::SessionCursor session_cursor;
+        size_t member_cursor = 0;
+        bool more = true;
+        while (more) {
+            keys.clear();
+            if (a->room) {
+                more = pb->list_room_members(*a->room, &member_cursor, batch, &keys);
+            } else {
+                more = pb->list_sessions(&session_cursor, batch, &keys);
+            }
+            if (!write_keys(a->pa.get(), keys)) {
+                return NULL;
+            }
+        }
+    }
+    return NULL;  // the response ends as `pa' is released.
+}
+
+// Publishes to the members of the rooms, only those of `device_type' if it
+// is not negative.
+static void publish_to_rooms(const std::vector<RoomKey>& target_rooms, const butil::IOBuf& data,
+                             int device_type, const PublishTrace::Ptr& trace) {
+    if (CAPTURE) {
+        CAPTURE->OnNotifyRooms(target_rooms, device_type, data.size());
+    }
+    if (target_rooms.size() == 1) {
+        for (Bucket::Ptr& pb : SPS->buckets()) {
+            pb->write_room(target_rooms[0], data, device_type, trace);
+        }
+    } else {
+        // a session in several of the rooms gets the event only once.
+        for (Bucket::Ptr& pb : SPS->buckets()) {
+            pb->write_rooms(target_rooms, data, device_type, trace);
+        }
+    }
+}
+
 class PushServiceImpl : public PushService {
 public:
     PushServiceImpl() {};
@@ -67,10 +323,14 @@ public:
         const brpc::URI& uri = cntl->http_request().uri();
         const std::string* pRooms = uri.GetQuery("r");
         const std::string* pAntiIdle = uri.GetQuery("i");
+        const std::string* pBatch = uri.GetQuery("b");
         UserKey key(0);
         if (!get_user_key_from_uri(uri, cntl, &key)) {
             return;
         }
+        if (!authenticate(cntl, key)) {
+            return;
+        }
         int anti_idle_s = 0;
         if (pAntiIdle) {
             if (!butil::StringToInt(*pAntiIdle, &anti_idle_s)) {
@@ -79,13 +339,50 @@ public:
             }
         }
 
+        // only a subscriber giving `b' knows the framed events.
+        int batch_window_us = 0;
+        if (pBatch) {
+            if (!butil::StringToInt(*pBatch, &batch_window_us)
+                    || batch_window_us > 1000000) {
+                cntl->SetFailed(EINVAL, "`b` (batch microseconds) is not a number within 1000000: %s", pBatch->c_str());
+                return;
+            }
+            if (batch_window_us < 0) {
+                batch_window_us = FLAGS_batch_window_us;
+            }
+        }
+
+        if (pRooms && FLAGS_max_rooms_per_session > 0) {
+            std::vector<std::string> pieces;
+            butil::SplitString(*pRooms, ',', &pieces);
+            int n = 0;
+            for (const std::string& s : pieces) {
+                n += !s.empty();
+            }
+            if (n > FLAGS_max_rooms_per_session) {
+                cntl->SetFailed(EINVAL, "`r` (room identities) has more than %d rooms",
+                                FLAGS_max_rooms_per_session);
+                return;
+            }
+        }
+
         Bucket& bucket = SPS->bucket(key.uid);
+        // before anything is allocated for the Wire. A reconnect replacing
+        // its own session does not add one.
+        if (bucket.is_full() && !bucket.get_session(key)) {
+            cntl->SetFailed(brpc::ELIMIT, "too many sessions, try another server");
+            return;
+        }
         brpc::ProgressiveAttachment* pa = cntl->CreateProgressiveAttachment(brpc::FORCE_STOP);
         pa->NotifyOnStopped(brpc::NewCallback<Bucket&, UserKey, void*>(remove_from_bucket, bucket, key, pa));
         std::unique_ptr<Session> session(new Session(key, pa, anti_idle_s));
         if (pRooms) {
             session->set_interested_room(*pRooms);
         }
+        if (pBatch) {
+            session->set_framed(true);
+            session->set_batch(batch_window_us, FLAGS_batch_max_bytes);
+        }
         bucket.add_session(session.release());
 
         VLOG(1) << "subscribe ok: " << bucket << " " << *bucket.get_session(key);
@@ -97,22 +394,50 @@ public:
                         google::protobuf::Closure* done) override {
         brpc::ClosureGuard done_guard(done);
         brpc::Controller *cntl = static_cast<brpc::Controller *>(cntl_base);
+        PublishTrace::Ptr trace = PublishTrace::Create();
 
         const brpc::URI &uri = cntl->http_request().uri();
         UserKey key(0);
-        if (!get_user_key_from_uri(uri, cntl, &key)) {
+        bool all_terminals = false;
+        if (!get_user_key_from_uri(uri, cntl, &key, &all_terminals)) {
             return;
         }
 
+        if (CAPTURE) {
+            CAPTURE->OnNotifyUser(key, all_terminals, cntl->request_attachment().size());
+        }
         Bucket &bucket = SPS->bucket(key.uid);
-        Session::Ptr ps = bucket.get_session(key);
         cntl->http_response().set_content_type("text/plain");
         butil::IOBufBuilder os;
+        if (all_terminals) {
+            // one lookup for every terminal of the user
+            std::vector<Session::Ptr> terminals = bucket.get_user_sessions(key.uid);
+            if (terminals.empty()) {
+                os << "offline\nuser=" << key.uid << " terminal=all\n";
+            }
+            for (const Session::Ptr& ps : terminals) {
+                int err = write_to_session(bucket, ps, cntl->request_attachment(), trace.get());
+                if (0 == err) {
+                    os << "delivered";
+                } else {
+                    os << "error";
+                }
+                os << "\nuser=" << key.uid << " terminal=" << ps->key().device_type << "\n";
+                if (err) {
+                    os << "err=" << err << " " << berror(err) << "\n";
+                }
+            }
+            trace->Annotate();
+            os.move_to(cntl->response_attachment());
+            return;
+        }
+
+        Session::Ptr ps = bucket.get_session(key);
         int err = 0;
-        if (!ps) {
+        if (!ps || ps->is_dead()) {
             os << "offline";
         } else {
-            err = ps->Write(cntl->request_attachment());
+            err = write_to_session(bucket, ps, cntl->request_attachment(), trace.get());
             if (0 == err) {
                 os << "delivered";
             } else {
@@ -123,6 +448,7 @@ public:
         if (err) {
             os << "err=" << err << " " << berror(err) << "\n";
         }
+        trace->Annotate();
         os.move_to(cntl->response_attachment());
     }
 
@@ -132,13 +458,22 @@ public:
                          google::protobuf::Closure* done) override {
         brpc::ClosureGuard done_guard(done);
         brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        PublishTrace::Ptr trace = PublishTrace::Create();
 
         const brpc::URI& uri = cntl->http_request().uri();
         const std::string* pRooms = uri.GetQuery("r");
+        const std::string* pDeviceType = uri.GetQuery("t");
         if (pRooms == NULL) {
             cntl->SetFailed(EINVAL, "`r` (room identities) is required");
             return;
         }
+        int device_type = -1;
+        if (pDeviceType) {
+            if (!butil::StringToInt(*pDeviceType, &device_type) || device_type < 0) {
+                cntl->SetFailed(EINVAL, "`t` (terminal type) is not a number: %s", pDeviceType->c_str());
+                return;
+            }
+        }
 
         // parse room identities
         std::vector<RoomKey> target_rooms;
@@ -153,15 +488,118 @@ public:
             return;
         }
 
-        for (const RoomKey& key : target_rooms) {
-            for (Bucket::Ptr& pb : SPS->buckets()) {
-                Room::Ptr pr = pb->get_room(key);
-                if (pr) {
-                    pr->Write(cntl->request_attachment());
-                }
+        publish_to_rooms(target_rooms, cntl->request_attachment(), device_type, trace);
+        // incomplete with single-writer buckets, which write after this.
+        trace->Annotate();
+        cntl->http_response().set_content_type("text/plain");
+    }
+
+    void notify_all(google::protobuf::RpcController* cntl_base,
+                    const HttpRequest* ,
+                    HttpResponse* ,
+                    google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+
+        const brpc::URI& uri = cntl->http_request().uri();
+        const std::string* pDeviceType = uri.GetQuery("t");
+        int device_type = -1;
+        if (pDeviceType) {
+            if (!butil::StringToInt(*pDeviceType, &device_type) || device_type < 0) {
+                cntl->SetFailed(EINVAL, "`t` (terminal type) is not a number: %s", pDeviceType->c_str());
+                return;
             }
         }
+
+        if (CAPTURE) {
+            CAPTURE->OnNotifyAll(device_type, cntl->request_attachment().size());
+        }
+        // write the buckets in parallel.
+        butil::Timer timer;
+        timer.start();
+        std::vector<Bucket::Ptr>& buckets = SPS->buckets();
+        std::vector<WriteAllArgs> args(buckets.size());
+        std::vector<bthread_t> tids(buckets.size(), 0);
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            args[i].bucket = buckets[i].get();
+            args[i].data = &cntl->request_attachment();
+            args[i].device_type = device_type;
+            if (bthread_start_background(&tids[i], NULL, RunWriteAll, &args[i]) != 0) {
+                tids[i] = 0;
+                RunWriteAll(&args[i]);
+            }
+        }
+        size_t delivered = 0;
+        size_t failed = 0;
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            if (tids[i]) {
+                bthread_join(tids[i], NULL);
+            }
+            delivered += args[i].delivered;
+            failed += args[i].failed;
+        }
+        timer.stop();
+
         cntl->http_response().set_content_type("text/plain");
+        butil::IOBufBuilder os;
+        os << "delivered=" << delivered
+           << " failed=" << failed
+           << " elapsed_us=" << timer.u_elapsed() << "\n";
+        os.move_to(cntl->response_attachment());
+    }
+
+    void disconnect(google::protobuf::RpcController* cntl_base,
+                    const HttpRequest* ,
+                    HttpResponse* ,
+                    google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+
+        const brpc::URI& uri = cntl->http_request().uri();
+        const std::string* pRoom = uri.GetQuery("r");
+        const std::string* pFrom = uri.GetQuery("from");
+        const std::string* pTo = uri.GetQuery("to");
+        const std::string* pSpread = uri.GetQuery("s");
+        std::unique_ptr<RoomKey> room;
+        int64_t min_uid = 0;
+        int64_t max_uid = 0;
+        if (pRoom) {
+            if (pRoom->empty()) {
+                cntl->SetFailed(EINVAL, "`r` (room identity) is empty");
+                return;
+            }
+            room.reset(new RoomKey(*pRoom));
+        } else if (pFrom && pTo) {
+            if (!butil::StringToInt64(*pFrom, &min_uid) || !butil::StringToInt64(*pTo, &max_uid)
+                    || min_uid > max_uid) {
+                cntl->SetFailed(EINVAL, "`from` and `to` (user identities) are not a range");
+                return;
+            }
+        } else {
+            cntl->SetFailed(EINVAL, "`r` (room identity) or `from` and `to` (user identities) is required");
+            return;
+        }
+        int spread_ms = 0;
+        if (pSpread && (!butil::StringToInt(*pSpread, &spread_ms) || spread_ms < 0)) {
+            cntl->SetFailed(EINVAL, "`s` (spread milliseconds) is not a number: %s", pSpread->c_str());
+            return;
+        }
+
+        butil::Timer timer;
+        timer.start();
+        size_t disconnected = 0;
+        for (Bucket::Ptr& pb : SPS->buckets()) {
+            std::vector<Session::Ptr> evicted = pb->evict_sessions(room.get(), min_uid, max_uid);
+            disconnected += evicted.size();
+            close_sessions(evicted, cntl->request_attachment(), spread_ms * 1000L);
+        }
+        timer.stop();
+
+        cntl->http_response().set_content_type("text/plain");
+        butil::IOBufBuilder os;
+        os << "disconnected=" << disconnected
+           << " elapsed_us=" << timer.u_elapsed() << "\n";
+        os.move_to(cntl->response_attachment());
     }
 
     void show_session(google::protobuf::RpcController* cntl_base,
@@ -227,6 +665,7 @@ public:
                     os << "\n                ";
                     os << "bucket[" << pb->index() << "] ";
                     os << "size=" << pr->size();
+                    os << " memory_bytes=" << pr->memory_bytes();
                 }
             }
             os << "\n";
@@ -234,6 +673,45 @@ public:
         os.move_to(cntl->response_attachment());
     }
 
+    void export_members(google::protobuf::RpcController* cntl_base,
+                        const HttpRequest* ,
+                        HttpResponse* ,
+                        google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+
+        const brpc::URI& uri = cntl->http_request().uri();
+        const std::string* pRoom = uri.GetQuery("r");
+        const std::string* pBucket = uri.GetQuery("b");
+        std::unique_ptr<ExportArgs> args(new ExportArgs);
+        args->bucket = -1;
+        if (pRoom) {
+            if (pRoom->empty()) {
+                cntl->SetFailed(EINVAL, "`r` (room identity) is empty");
+                return;
+            }
+            args->room.reset(new RoomKey(*pRoom));
+        }
+        if (pBucket) {
+            if (!butil::StringToInt(*pBucket, &args->bucket) || args->bucket < 0
+                    || args->bucket >= (int)SPS->buckets().size()) {
+                cntl->SetFailed(EINVAL, "`b` (bucket index) is not within [0, %d)",
+                                (int)SPS->buckets().size());
+                return;
+            }
+        }
+
+        cntl->http_response().set_content_type("text/plain");
+        args->pa.reset(cntl->CreateProgressiveAttachment());
+        bthread_t tid;
+        if (bthread_start_background(&tid, NULL, run_export, args.get()) != 0) {
+            LOG(ERROR) << "fail to start exporting members";
+            args->pa.reset();
+            return;
+        }
+        args.release();  // deleted by run_export
+    }
+
     void show_bucket(google::protobuf::RpcController* cntl_base,
                      const HttpRequest* ,
                      HttpResponse* ,
@@ -249,8 +727,82 @@ public:
         os.move_to(cntl->response_attachment());
     }
 
+    void show_hot_rooms(google::protobuf::RpcController* cntl_base,
+                        const HttpRequest* ,
+                        HttpResponse* ,
+                        google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+
+        const brpc::URI& uri = cntl->http_request().uri();
+        const std::string* pTop = uri.GetQuery("k");
+        const std::string* pBy = uri.GetQuery("by");
+        int k = 20;
+        if (pTop != NULL && (!butil::StringToInt(*pTop, &k) || k <= 0)) {
+            cntl->SetFailed(EINVAL, "`k` (number of rooms) must be a positive integer");
+            return;
+        }
+        if (pBy != NULL && *pBy != "publish" && *pBy != "cost" && *pBy != "lock") {
+            cntl->SetFailed(EINVAL, "`by` must be `publish`, `cost` or `lock`");
+            return;
+        }
+        const bool by_cost = (pBy != NULL && *pBy == "cost");
+
+        cntl->http_response().set_content_type("text/plain");
+        butil::IOBufBuilder os;
+        if (pBy != NULL && *pBy == "lock") {
+            for (const LockedRoom& r : collect_locked_rooms(k)) {
+                os << "room[" << r.room_id << "]"
+                   << " lock_us_per_second=" << r.lock_us_per_second << "\n";
+            }
+            os.move_to(cntl->response_attachment());
+            return;
+        }
+        for (const HotRoom& r : collect_hot_rooms(by_cost, k)) {
+            os << "room[" << r.room_id << "]"
+               << " publish_per_second=" << r.publish_per_second
+               << " cost_per_second=" << r.cost_per_second << "\n";
+        }
+        os.move_to(cntl->response_attachment());
+    }
+
 protected:
-    bool get_user_key_from_uri(const brpc::URI& uri, /*in*/brpc::Controller* cntl, /*out*/UserKey* key) {
+    struct WriteAllArgs {
+        Bucket* bucket;
+        const butil::IOBuf* data;
+        int device_type;
+        size_t delivered;
+        size_t failed;
+    };
+
+    static void* RunWriteAll(void* arg) {
+        WriteAllArgs* a = static_cast<WriteAllArgs*>(arg);
+        a->bucket->write_all(*a->data, a->device_type, &a->delivered, &a->failed);
+        return NULL;
+    }
+
+    bool authenticate(brpc::Controller* cntl, const UserKey& key) {
+        TokenVerifier* verifier = SPS->token_verifier();
+        if (!verifier) {
+            return true;
+        }
+        const std::string* pAuth = cntl->http_request().GetHeader("Authorization");
+        static const std::string kBearer = "Bearer ";
+        if (pAuth == NULL || pAuth->compare(0, kBearer.size(), kBearer) != 0) {
+            cntl->SetFailed(EPERM, "`Authorization: Bearer <token>` is required");
+            return false;
+        }
+        std::string reason;
+        if (!verifier->Verify(pAuth->substr(kBearer.size()), key.uid, &reason)) {
+            cntl->SetFailed(EPERM, "%s", reason.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // `t=all' is accepted only if `all_terminals' is given.
+    bool get_user_key_from_uri(const brpc::URI& uri, /*in*/brpc::Controller* cntl, /*out*/UserKey* key,
+                               /*out*/bool* all_terminals = NULL) {
         const std::string* pUid = uri.GetQuery("u");
         const std::string* pDeviceType = uri.GetQuery("t");
 
@@ -264,11 +816,18 @@ protected:
             return false;
         }
         int device_type = 0;
-        if (pDeviceType) {
+        if (pDeviceType && all_terminals && *pDeviceType == "all") {
+            *all_terminals = true;
+        } else if (pDeviceType) {
             if (!butil::StringToInt(*pDeviceType, &device_type)) {
                 cntl->SetFailed(EINVAL, "`t` (terminal type) is not a number: %s", pDeviceType->c_str());
                 return false;
             }
+            if (device_type < 0 || device_type > FLAGS_max_terminal_type) {
+                cntl->SetFailed(EINVAL, "`t` (terminal type) is not within [0, %d]: %d",
+                                FLAGS_max_terminal_type, device_type);
+                return false;
+            }
         }
         if (key) {
             key->uid = uid;
@@ -278,6 +837,225 @@ protected:
     }
 };
 
+// Publishes to the typed rooms and users of `request'.
+static void publish(const PublishRequest& request, PublishResponse* response) {
+    PublishTrace::Ptr trace = PublishTrace::Create();
+    butil::IOBuf data;
+    data.append(request.data());
+
+    std::vector<RoomKey> target_rooms;
+    target_rooms.reserve(request.room_ids_size());
+    for (const std::string& room_id : request.room_ids()) {
+        target_rooms.emplace_back(RoomKey(room_id));
+    }
+    if (!target_rooms.empty()) {
+        publish_to_rooms(target_rooms, data, request.room_terminal(), trace);
+    }
+
+    int64_t delivered = 0;
+    int64_t offline = 0;
+    for (const UserId& user : request.users()) {
+        if (CAPTURE) {
+            CAPTURE->OnNotifyUser(UserKey(user.uid(), user.terminal()),
+                                  user.all_terminals(), data.size());
+        }
+        Bucket& bucket = SPS->bucket(user.uid());
+        std::vector<Session::Ptr> terminals;
+        if (user.all_terminals()) {
+            terminals = bucket.get_user_sessions(user.uid());
+        } else {
+            Session::Ptr ps = bucket.get_session(UserKey(user.uid(), user.terminal()));
+            if (ps && !ps->is_dead()) {
+                terminals.push_back(ps);
+            }
+        }
+        bool ok = false;
+        for (const Session::Ptr& ps : terminals) {
+            if (write_to_session(bucket, ps, data, trace.get()) == 0) {
+                ok = true;
+            }
+        }
+        if (ok) {
+            ++delivered;
+        } else {
+            ++offline;
+        }
+    }
+    if (response) {
+        response->set_delivered_users(delivered);
+        response->set_offline_users(offline);
+    }
+    trace->Annotate();
+}
+
+// Publishes every message of a stream opened by PublishService::open_stream.
+class PublishStreamHandler : public brpc::StreamInputHandler {
+public:
+    int on_received_messages(brpc::StreamId id,
+                             butil::IOBuf *const messages[],
+                             size_t size) override {
+        for (size_t i = 0; i < size; ++i) {
+            PublishRequest request;
+            butil::IOBufAsZeroCopyInputStream wrapper(*messages[i]);
+            if (!request.ParseFromZeroCopyStream(&wrapper)) {
+                LOG_EVERY_SECOND(WARNING) << "fail to parse PublishRequest from stream=" << id;
+                continue;
+            }
+            publish(request, NULL);
+        }
+        return 0;
+    }
+
+    void on_idle_timeout(brpc::StreamId id) override {
+    }
+
+    void on_closed(brpc::StreamId id) override {
+        VLOG(1) << "publish stream=" << id << " closed";
+        delete this;
+    }
+};
+
+class PublishServiceImpl : public PublishService {
+public:
+    PublishServiceImpl() {};
+    virtual ~PublishServiceImpl() {};
+
+    void publish(google::protobuf::RpcController* cntl_base,
+                 const PublishRequest* request,
+                 PublishResponse* response,
+                 google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        sps::publish(*request, response);
+    }
+
+    void open_stream(google::protobuf::RpcController* cntl_base,
+                     const PublishStreamRequest* ,
+                     PublishStreamResponse* ,
+                     google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+
+        std::unique_ptr<PublishStreamHandler> handler(new PublishStreamHandler);
+        brpc::StreamOptions options;
+        options.handler = handler.get();
+        options.messages_in_batch = FLAGS_publish_stream_batch;
+        brpc::StreamId sd;
+        if (brpc::StreamAccept(&sd, *cntl, &options) != 0) {
+            cntl->SetFailed("Fail to accept stream");
+            return;
+        }
+        handler.release();  // deleted on_closed
+        VLOG(1) << "publish stream=" << sd << " opened";
+    }
+};
+
+// Removes the session of a Wire opened by SubscribeService::open_wire when
+// its stream closes. Messages from the subscriber are ignored.
+class WireStreamHandler : public brpc::StreamInputHandler {
+public:
+    WireStreamHandler(Bucket& bucket, const UserKey& key)
+        : bucket_(bucket), key_(key) {}
+
+    int on_received_messages(brpc::StreamId id,
+                             butil::IOBuf *const messages[],
+                             size_t size) override {
+        return 0;
+    }
+
+    void on_idle_timeout(brpc::StreamId id) override {
+    }
+
+    void on_closed(brpc::StreamId id) override {
+        VLOG(1) << "wire stream=" << id << " closed";
+        remove_from_bucket(bucket_, key_, Session::stream_connection_id(id));
+        delete this;
+    }
+
+private:
+    Bucket& bucket_;
+    UserKey key_;
+};
+
+class SubscribeServiceImpl : public SubscribeService {
+public:
+    SubscribeServiceImpl() {};
+    virtual ~SubscribeServiceImpl() {};
+
+    void open_wire(google::protobuf::RpcController* cntl_base,
+                   const SubscribeRequest* request,
+                   SubscribeResponse* ,
+                   google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+
+        if (request->user().terminal() < 0
+            || request->user().terminal() > FLAGS_max_terminal_type) {
+            cntl->SetFailed(EINVAL, "`terminal` is not within [0, %d]: %d",
+                            FLAGS_max_terminal_type, (int)request->user().terminal());
+            return;
+        }
+        UserKey key(request->user().uid(), request->user().terminal());
+        TokenVerifier* verifier = SPS->token_verifier();
+        if (verifier) {
+            std::string reason;
+            if (!request->has_token()) {
+                cntl->SetFailed(EPERM, "`token` is required");
+                return;
+            }
+            if (!verifier->Verify(request->token(), key.uid, &reason)) {
+                cntl->SetFailed(EPERM, "%s", reason.c_str());
+                return;
+            }
+        }
+        // framed and batched as `b', only if the subscriber gives it.
+        int batch_window_us = request->batch_window_us();
+        if (batch_window_us < 0) {
+            batch_window_us = FLAGS_batch_window_us;
+        } else if (batch_window_us > 1000000) {
+            cntl->SetFailed(EINVAL, "`batch_window_us` is not within 1000000");
+            return;
+        }
+        std::string rooms;
+        int n = 0;
+        for (int i = 0; i < request->room_ids_size(); ++i) {
+            if (request->room_ids(i).empty()) continue;
+            rooms.append(n++ ? "," : "").append(request->room_ids(i));
+        }
+        if (FLAGS_max_rooms_per_session > 0 && n > FLAGS_max_rooms_per_session) {
+            cntl->SetFailed(EINVAL, "`room_ids` has more than %d rooms",
+                            FLAGS_max_rooms_per_session);
+            return;
+        }
+
+        Bucket& bucket = SPS->bucket(key.uid);
+        if (bucket.is_full() && !bucket.get_session(key)) {  // see subscribe
+            cntl->SetFailed(brpc::ELIMIT, "too many sessions, try another server");
+            return;
+        }
+        std::unique_ptr<WireStreamHandler> handler(new WireStreamHandler(bucket, key));
+        brpc::StreamOptions options;
+        options.handler = handler.get();
+        options.max_buf_size = FLAGS_wire_stream_max_buf_size;
+        brpc::StreamId sd;
+        if (brpc::StreamAccept(&sd, *cntl, &options) != 0) {
+            cntl->SetFailed("Fail to accept stream");
+            return;
+        }
+        handler.release();  // deleted on_closed
+        std::unique_ptr<Session> session(new Session(key, sd, request->anti_idle_s()));
+        if (!rooms.empty()) {
+            session->set_interested_room(rooms);
+        }
+        if (request->has_batch_window_us()) {
+            session->set_framed(true);
+            session->set_batch(batch_window_us, FLAGS_batch_max_bytes);
+        }
+        bucket.add_session(session.release());
+
+        VLOG(1) << "open wire ok: " << bucket << " " << *bucket.get_session(key);
+    }
+};
+
 }  // namespace sps
 
 int main(int argc, char* argv[]) {
@@ -285,10 +1063,24 @@ int main(int argc, char* argv[]) {
     GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
 
     sps::ServerOptions push_server_options;
+    push_server_options.use_execution_queue = FLAGS_bucket_execution_queue;
+    push_server_options.max_sessions_per_bucket = FLAGS_max_sessions_per_bucket;
+    push_server_options.on_session_added = sps::capture_subscribe;
+    push_server_options.on_session_removed = sps::capture_unsubscribe;
+    push_server_options.on_session_rooms_changed = sps::capture_room_change;
     sps::SimplePushServer::Ptr push_server(new sps::SimplePushServer(push_server_options));
     sps::SPS = push_server.get();
     brpc::Server& server = push_server->brpc_server();
 
+    std::unique_ptr<sps::TrafficCapture> capture;
+    if (!FLAGS_capture_file.empty()) {
+        capture.reset(new sps::TrafficCapture);
+        if (capture->Open(FLAGS_capture_file, FLAGS_capture_max_mb * 1024L * 1024L) != 0) {
+            return -1;
+        }
+        sps::CAPTURE = capture.get();
+    }
+
     sps::PushServiceImpl push_svc;
 
     if (server.AddService(&push_svc,
@@ -297,15 +1089,34 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
+    sps::PublishServiceImpl publish_svc;
+    if (server.AddService(&publish_svc,
+                          brpc::SERVER_DOESNT_OWN_SERVICE) != 0) {
+        LOG(ERROR) << "Fail to add publish_svc";
+        return -1;
+    }
+
+    sps::SubscribeServiceImpl subscribe_svc;
+    if (server.AddService(&subscribe_svc,
+                          brpc::SERVER_DOESNT_OWN_SERVICE) != 0) {
+        LOG(ERROR) << "Fail to add subscribe_svc";
+        return -1;
+    }
+
     brpc::ServerOptions options;
     options.idle_timeout_sec = FLAGS_idle_timeout_s;
-    options.mutable_ssl_options()->default_cert.certificate = FLAGS_certificate;
-    options.mutable_ssl_options()->default_cert.private_key = FLAGS_private_key;
+    brpc::ServerSSLOptions* ssl_options = options.mutable_ssl_options();
+    ssl_options->default_cert.certificate = FLAGS_certificate;
+    ssl_options->default_cert.private_key = FLAGS_private_key;
+    ssl_options->ciphers = FLAGS_ssl_ciphers;
+    ssl_options->ecdhe_curve_name = FLAGS_ssl_ecdhe_curve;
+    ssl_options->session_lifetime_s = FLAGS_ssl_session_lifetime_s;
     if (server.Start(FLAGS_port, &options) != 0) {
         LOG(ERROR) << "Fail to start server";
         return -1;
     }
 
     server.RunUntilAskedToQuit();
+    sps::CAPTURE = nullptr;
     return 0;
 }
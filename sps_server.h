@@ -4,6 +4,7 @@
 #include <memory>
 #include <brpc/server.h>
 
+#include "sps_auth.h"
 #include "sps_bucket.h"
 
 
@@ -18,9 +19,13 @@ public:
         return *buckets_[uid % buckets_.size()];  // uid promotes to unsigned
     }
     std::vector<Bucket::Ptr>& buckets() { return buckets_; }
+    // Verifies the tokens of every kind of Wire, NULL if -jwt_secret is
+    // not set.
+    TokenVerifier* token_verifier() { return token_verifier_.get(); }
 private:
     std::unique_ptr<brpc::Server> brpc_server_;
     std::vector<Bucket::Ptr> buckets_;
+    std::unique_ptr<TokenVerifier> token_verifier_;
 };
 
 }  // namespace sps
@@ -1,21 +1,40 @@
+#include <set>
+#include <limits>
 #include <gtest/gtest.h>
 #include <gflags/gflags.h>
 #include <butil/logging.h>
 #include <butil/rand_util.h>
 #include <butil/string_printf.h>
+#include <butil/strings/string_split.h>
+#include <butil/strings/string_number_conversions.h>
+#include <butil/time.h>
 #include <bthread/bthread.h>
 #include <bthread/unstable.h>
+#include <bvar/bvar.h>
 #include <brpc/server.h>
 
+#include "sps_auth.h"
 #include "sps_bucket.h"
+#include "sps_capture.h"
 #include "sps_server.h"
 
 
 DEFINE_int32(sps_test_concurrency, 10000, "the number of bthread that BucketTestMultiThreaded setup with");
 DEFINE_int32(sps_test_room_pool_size, 10000, "the number of rooms that a session can join");
 DEFINE_int32(sps_test_simulation_sec, 1, "the seconds (approximately) session simulation lasts");
+DEFINE_int32(sps_test_simulation_pause_us, 1000, "the max microseconds a simulated session pauses between subscribe and unsubscribe. set to 0 does not pause.");
+DEFINE_string(sps_test_fanout_room_sizes, "10000,100000,1000000", "the room sizes that RoomFanOutTest measures");
+DEFINE_int32(sps_test_fanout_rounds, 10, "the number of publishes per room size in RoomFanOutTest");
 DEFINE_int32(sps_test_dummy_server_port, -1, "the port of brpc dummy server. set to -1 does not start the dummy server.");
 
+DECLARE_int32(room_parallel_write_threshold);
+DECLARE_int32(room_write_chunk_size);
+DECLARE_int32(room_write_max_parallelism);
+DECLARE_int32(hot_room_top_k);
+DECLARE_int32(hot_room_period_s);
+DECLARE_int32(hot_room_sample_1_in);
+DECLARE_int32(room_lock_sample_1_in);
+
 
 namespace sps {
 SimplePushServer* SPS = nullptr;
@@ -27,7 +46,10 @@ using namespace sps;
 class BucketTest : public testing::Test {
 protected:
     void SetUp() override {
-        bucket_ = new Bucket(0, ServerOptions());
+        bucket_ = new Bucket(0, options());
+    }
+    virtual ServerOptions options() const {
+        return ServerOptions();
     }
     void TearDown() override {
         delete bucket_;
@@ -194,10 +216,655 @@ TEST_F(BucketTest, Update_Session_Rooms_4) {
     bucket_->update_session_rooms(key, "earth");
 }
 
+TEST_F(BucketTest, Del_Session_From_Crowded_Room) {
+    for (int i = 0; i < 5; ++i) {
+        std::unique_ptr<Session> session(new Session(UserKey(i), nullptr));
+        session->set_interested_room("earth,mars");
+        bucket_->add_session(session.release());
+    }
+    // removing from the middle swaps the last member into the hole.
+    bucket_->del_session(UserKey(1));
+    bucket_->del_session(UserKey(0));
+    ASSERT_EQ(3, bucket_->get_room(RoomKey("earth"))->size());
+    ASSERT_EQ(3, bucket_->get_room(RoomKey("mars"))->size());
+    for (int i = 2; i < 5; ++i) {
+        ASSERT_TRUE(bucket_->get_room(RoomKey("earth"))->has_session(bucket_->get_session(UserKey(i))));
+        ASSERT_TRUE(bucket_->get_room(RoomKey("mars"))->has_session(bucket_->get_session(UserKey(i))));
+    }
+    bucket_->del_session(UserKey(4));
+    bucket_->del_session(UserKey(2));
+    bucket_->del_session(UserKey(3));
+    ASSERT_EQ(0, bucket_->count_room());
+}
+
+TEST_F(BucketTest, Join_Room_Once) {
+    UserKey key(__LINE__);
+    std::unique_ptr<Session> session(new Session(key, nullptr));
+    session->set_interested_room("earth,mars,earth");
+    ASSERT_EQ(2, session->interested_rooms().size());
+    bucket_->add_session(session.release());
+    ASSERT_EQ(1, bucket_->get_room(RoomKey("earth"))->size());
+}
+
+TEST_F(BucketTest, Get_User_Sessions) {
+    int64_t uid = __LINE__;
+    for (int16_t t = 0; t < 3; ++t) {
+        std::unique_ptr<Session> session(new Session(UserKey(uid, t), nullptr));
+        bucket_->add_session(session.release());
+    }
+    // replaces the existing terminal
+    std::unique_ptr<Session> session(new Session(UserKey(uid, 1), nullptr));
+    bucket_->add_session(session.release());
+    ASSERT_EQ(3, bucket_->get_user_sessions(uid).size());
+    ASSERT_EQ(0, bucket_->get_user_sessions(uid + 1).size());
+
+    bucket_->del_session(UserKey(uid, 0));
+    std::vector<Session::Ptr> terminals = bucket_->get_user_sessions(uid);
+    ASSERT_EQ(2, terminals.size());
+    for (const Session::Ptr& ps : terminals) {
+        ASSERT_EQ(bucket_->get_session(ps->key()), ps);
+    }
+    bucket_->del_session(UserKey(uid, 1));
+    bucket_->del_session(UserKey(uid, 2));
+    ASSERT_EQ(0, bucket_->get_user_sessions(uid).size());
+}
+
+TEST_F(BucketTest, Write_Rooms) {
+    const char* rooms[] = { "earth,mars", "mars", "mercury,earth,mars", "venus" };
+    for (int i = 0; i < 4; ++i) {
+        std::unique_ptr<Session> session(new Session(UserKey(i), nullptr));
+        session->set_interested_room(rooms[i]);
+        bucket_->add_session(session.release());
+    }
+    std::vector<RoomKey> keys;
+    keys.push_back(RoomKey("earth"));
+    keys.push_back(RoomKey("mars"));
+    keys.push_back(RoomKey("jupiter"));
+    butil::IOBuf data;
+    data.append("event");
+    ASSERT_EQ(3, bucket_->write_rooms(keys, data));
+    ASSERT_EQ(3, bucket_->write_rooms(keys, data));
+    keys.push_back(RoomKey("venus"));
+    ASSERT_EQ(4, bucket_->write_rooms(keys, data));
+}
+
+TEST_F(BucketTest, Write_Room_Of_Terminal) {
+    std::vector<Session::Ptr> sessions;
+    for (int i = 0; i < 6; ++i) {
+        Session::Ptr ps(new Session(UserKey(i / 3, i % 3), nullptr));
+        ps->set_interested_room("earth");
+        ps->set_batch(1000000, 1 << 20);  // keeps what is written
+        bucket_->add_session(ps);
+        sessions.push_back(ps);
+    }
+    butil::IOBuf data;
+    data.append("event");
+    const int saved_threshold = FLAGS_room_parallel_write_threshold;
+    for (int threshold : { 0, 1 }) {  // the serial and the parallel fan-out
+        FLAGS_room_parallel_write_threshold = threshold;
+        bucket_->write_room(RoomKey("earth"), data, 1);
+    }
+    FLAGS_room_parallel_write_threshold = saved_threshold;
+    for (const Session::Ptr& ps : sessions) {
+        ASSERT_EQ(ps->key().device_type == 1 ? 10u : 0u, ps->batched_bytes());
+    }
+
+    std::vector<RoomKey> keys;
+    keys.push_back(RoomKey("earth"));
+    ASSERT_EQ(2, bucket_->write_rooms(keys, data, 2));
+    ASSERT_EQ(6, bucket_->write_rooms(keys, data));
+
+    bucket_->del_session(UserKey(0, 1));
+    ASSERT_EQ(5, bucket_->get_room(RoomKey("earth"))->size());
+    ASSERT_TRUE(bucket_->get_room(RoomKey("earth"))->has_session(sessions[4]));
+    ASSERT_FALSE(bucket_->get_room(RoomKey("earth"))->has_session(sessions[1]));
+    for (const Session::Ptr& ps : sessions) {
+        ps->Destroy();
+    }
+}
+
+class BucketCapTest : public BucketTest {
+protected:
+    ServerOptions options() const override {
+        ServerOptions options;
+        options.max_sessions_per_bucket = 2;
+        return options;
+    }
+};
+
+TEST_F(BucketCapTest, Memory_Accounting) {
+    ASSERT_EQ(0, bucket_->session_bytes());
+    ASSERT_EQ(0, bucket_->room_bytes());
+    UserKey key1(__LINE__);
+    UserKey key2(__LINE__);
+    std::unique_ptr<Session> session1(new Session(key1, nullptr));
+    session1->set_interested_room("earth,mars");
+    bucket_->add_session(session1.release());
+    ASSERT_FALSE(bucket_->is_full());
+    const int64_t one_session_bytes = bucket_->session_bytes();
+    const int64_t two_rooms_bytes = bucket_->room_bytes();
+    ASSERT_LT(0, one_session_bytes);
+    ASSERT_LT(0, two_rooms_bytes);
+
+    std::unique_ptr<Session> session2(new Session(key2, nullptr));
+    session2->set_interested_room("mars");
+    bucket_->add_session(session2.release());
+    ASSERT_TRUE(bucket_->is_full());
+    ASSERT_LT(one_session_bytes, bucket_->session_bytes());
+    ASSERT_LT(two_rooms_bytes, bucket_->room_bytes());
+    ASSERT_LE(sizeof(Session), bucket_->get_session(key1)->memory_bytes());
+    ASSERT_LE(sizeof(Room) + 2 * sizeof(Room::Member),
+              bucket_->get_room(RoomKey("mars"))->memory_bytes());
+
+    bucket_->del_session(key1);
+    ASSERT_FALSE(bucket_->is_full());
+    bucket_->del_session(key2);
+    ASSERT_EQ(0, bucket_->session_bytes());
+    ASSERT_EQ(0, bucket_->room_bytes());
+}
+
+static int64_t exposed_count(const std::string& name) {
+    int64_t n = 0;
+    butil::StringToInt64(bvar::Variable::describe_exposed(name), &n);
+    return n;
+}
+
+TEST_F(BucketTest, Trace_Write_Room) {
+    std::unique_ptr<Session> session(new Session(UserKey(__LINE__), nullptr));
+    session->set_interested_room("earth");
+    bucket_->add_session(session.release());
+    butil::IOBuf data;
+    data.append("event");
+
+    const int64_t traced = exposed_count("sps_publish_last_write_count");
+    const int64_t lock_waits = exposed_count("sps_bucket_0_room_lock_wait_count");
+    {
+        PublishTrace::Ptr trace = PublishTrace::Create();
+        bucket_->write_room(RoomKey("earth"), data, -1, trace);
+        ASSERT_EQ(traced, exposed_count("sps_publish_last_write_count"));
+    }
+    // recorded when the trace is released
+    ASSERT_EQ(traced + 1, exposed_count("sps_publish_last_write_count"));
+    ASSERT_LT(lock_waits, exposed_count("sps_bucket_0_room_lock_wait_count"));
+}
+
+TEST_F(BucketTest, Write_All) {
+    for (int i = 0; i < 6; ++i) {
+        std::unique_ptr<Session> session(new Session(UserKey(i / 2, i % 2), nullptr));
+        bucket_->add_session(session.release());
+    }
+    butil::IOBuf data;
+    data.append("notice");
+    size_t delivered = 0;
+    size_t failed = 0;
+    bucket_->write_all(data, -1, &delivered, &failed);
+    ASSERT_EQ(6, delivered);
+    ASSERT_EQ(0, failed);
+    bucket_->write_all(data, 1, &delivered, &failed);
+    ASSERT_EQ(3, delivered);
+}
+
+TEST_F(BucketTest, Reap_Dead_Session) {
+    UserKey key1(__LINE__);
+    UserKey key2(__LINE__);
+    std::unique_ptr<Session> session1(new Session(key1, nullptr));
+    std::unique_ptr<Session> session2(new Session(key2, nullptr));
+    session1->set_interested_room("earth,mars");
+    session2->set_interested_room("earth");
+    bucket_->add_session(session1.release());
+    bucket_->add_session(session2.release());
+
+    Session::Ptr ps = bucket_->get_session(key1);
+    bucket_->on_write_failed(ps.get(), EPIPE);
+    bucket_->on_write_failed(ps.get(), EPIPE);
+    ASSERT_TRUE(ps->is_dead());
+
+    // the reaper runs every -dead_session_reap_interval_ms.
+    const int64_t deadline_us = butil::gettimeofday_us() + 10000000L;
+    while (bucket_->get_session(key1) && butil::gettimeofday_us() < deadline_us) {
+        bthread_usleep(1000);
+    }
+    ASSERT_FALSE(bucket_->get_session(key1));
+    ASSERT_TRUE(bucket_->get_session(key2).get());
+    ASSERT_FALSE(bucket_->get_room(RoomKey("mars")));
+    ASSERT_EQ(1, bucket_->get_room(RoomKey("earth"))->size());
+}
+
+TEST_F(BucketTest, Evict_Sessions) {
+    const char* rooms[] = { "stage", "stage,lobby", "lobby" };
+    for (int i = 0; i < 3; ++i) {
+        std::unique_ptr<Session> session(new Session(UserKey(100 + i), nullptr));
+        session->set_interested_room(rooms[i]);
+        bucket_->add_session(session.release());
+    }
+    RoomKey stage("stage");
+    std::vector<Session::Ptr> evicted = bucket_->evict_sessions(&stage, 0, 0);
+    ASSERT_EQ(2u, evicted.size());
+    ASSERT_TRUE(evicted[0]->is_dead());
+    ASSERT_EQ(1u, bucket_->count_session());
+    ASSERT_FALSE(bucket_->get_room(stage));
+    ASSERT_EQ(1, bucket_->get_room(RoomKey("lobby"))->size());
+
+    ASSERT_TRUE(bucket_->evict_sessions(NULL, 0, 101).empty());
+    evicted = bucket_->evict_sessions(NULL, 101, 102);
+    ASSERT_EQ(1u, evicted.size());
+    ASSERT_EQ(102, evicted[0]->key().uid);
+    ASSERT_EQ(0u, bucket_->count_session());
+    ASSERT_FALSE(bucket_->get_room(RoomKey("lobby")));
+}
+
+TEST(BucketHookTest, Session_Joins_And_Leaves) {
+    std::vector<std::string> events;
+    bthread::Mutex mutex;  // the reaper calls from its own bthread
+    ServerOptions options;
+    options.on_session_added = [&](const Session& s) {
+        BAIDU_SCOPED_LOCK(mutex);
+        events.push_back("+" + butil::Int64ToString(s.key().uid));
+    };
+    options.on_session_removed = [&](const Session& s) {
+        BAIDU_SCOPED_LOCK(mutex);
+        events.push_back("-" + butil::Int64ToString(s.key().uid));
+    };
+    options.on_session_rooms_changed = [&](const Session& s) {
+        BAIDU_SCOPED_LOCK(mutex);
+        events.push_back("~" + butil::Int64ToString(s.key().uid));
+    };
+    std::unique_ptr<Bucket> bucket(new Bucket(0, options));
+    UserKey key(1);
+    bucket->add_session(new Session(key, nullptr));
+    bucket->update_session_rooms(key, "mars");
+    bucket->update_session_rooms(key, "mars");  // unchanged
+    bucket->add_session(new Session(key, nullptr));  // replaced
+    bucket->on_write_failed(bucket->get_session(key).get(), EPIPE);
+    const int64_t deadline_us = butil::gettimeofday_us() + 10000000L;
+    while (bucket->get_session(key) && butil::gettimeofday_us() < deadline_us) {
+        bthread_usleep(1000);
+    }
+    ASSERT_FALSE(bucket->get_session(key));  // reaped
+    bucket->add_session(new Session(UserKey(2), nullptr));
+    ASSERT_EQ(1u, bucket->evict_sessions(NULL, 2, 2).size());
+
+    BAIDU_SCOPED_LOCK(mutex);
+    const std::vector<std::string> expected = { "+1", "~1", "-1", "+1", "-1", "+2", "-2" };
+    ASSERT_EQ(expected, events);
+}
+
+TEST_F(BucketTest, List_Sessions_And_Members) {
+    for (int i = 0; i < 5; ++i) {
+        std::unique_ptr<Session> session(new Session(UserKey(200 + i / 2, i % 2), nullptr));
+        session->set_interested_room(i < 4 ? "stage" : "lobby");
+        bucket_->add_session(session.release());
+    }
+
+    std::vector<UserKey> keys;
+    Bucket::SessionCursor session_cursor;
+    ASSERT_TRUE(bucket_->list_sessions(&session_cursor, 2, &keys));
+    ASSERT_TRUE(bucket_->list_sessions(&session_cursor, 2, &keys));
+    ASSERT_FALSE(bucket_->list_sessions(&session_cursor, 2, &keys));
+    ASSERT_EQ(5u, keys.size());
+    std::set<int64_t> seen;
+    for (const UserKey& key : keys) {
+        seen.insert(key.uid * 2 + key.device_type);
+    }
+    ASSERT_EQ(5u, seen.size());
+
+    keys.clear();
+    size_t member_cursor = 0;
+    ASSERT_TRUE(bucket_->list_room_members(RoomKey("stage"), &member_cursor, 3, &keys));
+    ASSERT_EQ(3u, keys.size());
+    ASSERT_FALSE(bucket_->list_room_members(RoomKey("stage"), &member_cursor, 3, &keys));
+    ASSERT_EQ(4u, keys.size());
+    keys.clear();
+    member_cursor = 0;
+    ASSERT_FALSE(bucket_->list_room_members(RoomKey("nowhere"), &member_cursor, 3, &keys));
+    ASSERT_TRUE(keys.empty());
+}
+
+TEST_F(BucketTest, Batch_Session_Write) {
+    Session::Ptr ps(new Session(UserKey(__LINE__), nullptr));
+    ps->set_framed(true);
+    ps->set_batch(1000000, 64);
+    butil::IOBuf data;
+    data.append("0123456789");
+    ASSERT_EQ(0, ps->Write(data));
+    ASSERT_EQ(0, ps->Write(data));
+    ASSERT_EQ(32, ps->batched_bytes());  // "10\r\n0123456789\r\n" each
+    ASSERT_EQ(0, ps->Write(data));
+    ASSERT_EQ(48, ps->batched_bytes());
+    ASSERT_EQ(0, ps->Write(data));
+    ASSERT_EQ(0, ps->batched_bytes());  // flushed when reaching max bytes
+    ASSERT_EQ(0, ps->Write(data));
+    ps->set_batch(0, 0);
+    ASSERT_EQ(0, ps->Write(data));
+    ASSERT_EQ(0, ps->batched_bytes());  // the pending event is sent first
+    ps->set_batch(1000000, 64);
+    ASSERT_EQ(0, ps->Write(data));
+    ps->Destroy();
+    ASSERT_EQ(0, ps->batched_bytes());  // flushed before the Wire ends
+    ASSERT_EQ(ECONNRESET, ps->Write(data));
+    ASSERT_EQ(0, ps->batched_bytes());  // nor batched once destroyed
+
+    Session::Ptr ps2(new Session(UserKey(__LINE__), nullptr));
+    ps2->set_framed(true);
+    ps2->set_batch(1000, 64);
+    ASSERT_EQ(0, ps2->Write(data));
+    ASSERT_EQ(16, ps2->batched_bytes());
+    const int64_t deadline_us = butil::gettimeofday_us() + 10000000L;
+    while (ps2->batched_bytes() && butil::gettimeofday_us() < deadline_us) {
+        bthread_usleep(1000);
+    }
+    ASSERT_EQ(0, ps2->batched_bytes());  // flushed by timer
+    ps2->Destroy();
+
+    Session::Ptr ps3(new Session(UserKey(__LINE__), nullptr));
+    ps3->set_batch(1000000, 64);
+    ASSERT_EQ(0, ps3->Write(data));
+    ASSERT_EQ(10, ps3->batched_bytes());  // unframed unless asked for
+    ps3->Destroy();
+}
+
+class RoomFanOutTest : public testing::Test {
+protected:
+    void SetUp() override {
+        saved_threshold_ = FLAGS_room_parallel_write_threshold;
+        saved_chunk_size_ = FLAGS_room_write_chunk_size;
+        saved_parallelism_ = FLAGS_room_write_max_parallelism;
+    }
+    void TearDown() override {
+        FLAGS_room_parallel_write_threshold = saved_threshold_;
+        FLAGS_room_write_chunk_size = saved_chunk_size_;
+        FLAGS_room_write_max_parallelism = saved_parallelism_;
+    }
+
+    // publish to rooms of each configured size and log the throughput.
+    // every session batches what it is written, so the writes are counted
+    // from the batched bytes.
+    void measure_write(const char* label) {
+        std::vector<std::string> pieces;
+        butil::SplitString(FLAGS_sps_test_fanout_room_sizes, ',', &pieces);
+        butil::IOBuf data;
+        data.append("{\"event\":\"fan-out\"}");
+        for (const std::string& s : pieces) {
+            int64_t room_size = 0;
+            if (!butil::StringToInt64(s, &room_size) || room_size <= 0) {
+                continue;
+            }
+            std::unique_ptr<Bucket> bucket(new Bucket(0, ServerOptions()));
+            std::vector<Session::Ptr> sessions;
+            sessions.reserve(room_size);
+            for (int64_t i = 0; i < room_size; ++i) {
+                Session::Ptr ps(new Session(UserKey(i), nullptr));
+                ps->set_interested_room("hall");
+                ps->set_batch(3600 * 1000000L, std::numeric_limits<size_t>::max());
+                bucket->add_session(ps);
+                sessions.push_back(ps);
+            }
+            Room::Ptr room = bucket->get_room(RoomKey("hall"));
+            ASSERT_EQ((size_t)room_size, room->size());
+            room->Write(data);  // arms the batch timers out of the timing
+            const size_t event_bytes = sessions[0]->batched_bytes();
+
+            butil::Timer timer;
+            timer.start();
+            for (int i = 0; i < FLAGS_sps_test_fanout_rounds; ++i) {
+                room->Write(data);
+            }
+            timer.stop();
+            int64_t writes = 0;
+            for (const Session::Ptr& ps : sessions) {
+                writes += ps->batched_bytes() / event_bytes - 1;
+                ps->Destroy();
+            }
+            ASSERT_EQ(room_size * FLAGS_sps_test_fanout_rounds, writes);
+            LOG(INFO) << label << " room_size=" << room_size
+                      << " rounds=" << FLAGS_sps_test_fanout_rounds
+                      << " us_per_publish=" << timer.u_elapsed() / FLAGS_sps_test_fanout_rounds
+                      << " writes_per_sec=" << writes * 1000000 / std::max<int64_t>(timer.u_elapsed(), 1);
+        }
+    }
+
+    int saved_threshold_;
+    int saved_chunk_size_;
+    int saved_parallelism_;
+};
+
+// The benchmarks below build rooms of up to a million sessions, run them by
+// --gtest_also_run_disabled_tests.
+TEST_F(RoomFanOutTest, DISABLED_Write_Throughput) {
+    FLAGS_room_parallel_write_threshold = 0;
+    measure_write("sequential");
+}
+
+TEST_F(RoomFanOutTest, DISABLED_Parallel_Write_Latency) {
+    measure_write("parallel");
+}
+
+TEST_F(RoomFanOutTest, Parallel_Write_Each_Member_Once) {
+    FLAGS_room_parallel_write_threshold = 10;
+    FLAGS_room_write_chunk_size = 7;
+    FLAGS_room_write_max_parallelism = 4;  // fewer than the chunks of 7
+    butil::IOBuf data;
+    data.append("event");
+    for (bool use_queue : { false, true }) {
+        ServerOptions options;
+        options.use_execution_queue = use_queue;
+        std::unique_ptr<Bucket> bucket(new Bucket(0, options));
+        std::vector<Session::Ptr> sessions;
+        for (int i = 0; i < 100; ++i) {
+            // partitions of three terminal types, which chunks span.
+            Session::Ptr ps(new Session(UserKey(i, i % 3), nullptr));
+            ps->set_interested_room(i % 2 ? "hall" : "hall,lobby");
+            ps->set_batch(1000000, 1 << 20);  // keeps what is written
+            bucket->add_session(ps);
+            sessions.push_back(ps);
+        }
+        bucket->write_room(RoomKey("hall"), data);
+        const std::vector<RoomKey> keys = { RoomKey("hall"), RoomKey("lobby") };
+        ASSERT_EQ(100u, bucket->write_rooms(keys, data));
+        bucket->count_session();  // waits for the write in the queue
+        for (const Session::Ptr& ps : sessions) {
+            ASSERT_EQ(10u, ps->batched_bytes()) << "uid=" << ps->key().uid
+                                                << " use_queue=" << use_queue;
+            ps->Destroy();
+        }
+    }
+}
+
+TEST(TokenVerifierTest, Verify) {
+    TokenVerifier verifier("secret", "uid", 100);
+    std::string reason;
+    std::string token = TokenVerifier::Sign("secret", "{\"uid\":42}");
+    ASSERT_TRUE(verifier.Verify(token, 42, &reason)) << reason;
+    ASSERT_TRUE(verifier.Verify(token, 42, &reason)) << reason;  // cached
+    ASSERT_FALSE(verifier.Verify(token, 43, &reason));
+
+    std::string str_uid = TokenVerifier::Sign("secret", "{\"uid\":\"42\"}");
+    ASSERT_TRUE(verifier.Verify(str_uid, 42, &reason)) << reason;
+
+    std::string forged = TokenVerifier::Sign("guess", "{\"uid\":42}");
+    ASSERT_FALSE(verifier.Verify(forged, 42, &reason));
+    ASSERT_FALSE(verifier.Verify("not.a-token", 42, &reason));
+
+    std::string expired = TokenVerifier::Sign("secret", "{\"uid\":42,\"exp\":1}");
+    ASSERT_FALSE(verifier.Verify(expired, 42, &reason));
+    ASSERT_FALSE(verifier.Verify(expired, 42, &reason));  // cached
+}
+
+TEST(HotRoomsTest, Top_K) {
+    const int saved_top_k = FLAGS_hot_room_top_k;
+    const int saved_period_s = FLAGS_hot_room_period_s;
+    const int saved_sample_1_in = FLAGS_hot_room_sample_1_in;
+    FLAGS_hot_room_top_k = 2;
+    FLAGS_hot_room_period_s = 1;
+    FLAGS_hot_room_sample_1_in = 1;  // counts every publish
+    HotRooms hot_rooms;
+    FLAGS_hot_room_top_k = saved_top_k;
+    FLAGS_hot_room_period_s = saved_period_s;
+
+    RoomKey chatty("chatty"), crowded("crowded"), quiet("quiet");
+    for (int i = 0; i < 10; ++i) {
+        hot_rooms.Update(chatty, 1, 100);
+    }
+    hot_rooms.Update(crowded, 1000, 100);
+    hot_rooms.Update(crowded, 1000, 100);
+    hot_rooms.Update(quiet, 1, 100);
+
+    std::vector<HotRoom> by_publish, by_cost;
+    hot_rooms.GetHotRooms(&by_publish, &by_cost);
+    ASSERT_TRUE(by_publish.empty());  // the period is not complete yet
+
+    bthread_usleep(1000000);
+    hot_rooms.GetHotRooms(&by_publish, &by_cost);
+    ASSERT_EQ(2u, by_publish.size());
+    ASSERT_EQ("chatty", by_publish[0].room_id);
+    ASSERT_EQ("crowded", by_publish[1].room_id);
+    ASSERT_EQ(2u, by_cost.size());
+    ASSERT_EQ("crowded", by_cost[0].room_id);
+    ASSERT_DOUBLE_EQ(200000.0, by_cost[0].cost_per_second);
+
+    // the publishes of a room are seen by every bucket it spans.
+    std::vector<HotRoom> rooms = by_publish;
+    rooms.insert(rooms.end(), by_publish.begin(), by_publish.end());
+    HotRooms::Merge(&rooms, true, 1);
+    ASSERT_EQ(1u, rooms.size());
+    ASSERT_EQ("crowded", rooms[0].room_id);
+    ASSERT_DOUBLE_EQ(2.0, rooms[0].publish_per_second);
+    ASSERT_DOUBLE_EQ(400000.0, rooms[0].cost_per_second);
+    FLAGS_hot_room_sample_1_in = saved_sample_1_in;
+}
+
+TEST(LockStatsTest, Instrumented_Mutex) {
+    const int saved_period_s = FLAGS_hot_room_period_s;
+    const int saved_sample_1_in = FLAGS_room_lock_sample_1_in;
+    FLAGS_hot_room_period_s = 1;
+    FLAGS_room_lock_sample_1_in = 1;
+    LockStats stats(1000);
+    FLAGS_hot_room_period_s = saved_period_s;
+
+    RoomKey hot("hot");
+    InstrumentedMutex bucket_mutex(&stats);
+    InstrumentedMutex room_mutex(&stats, &hot);
+    {
+        BAIDU_SCOPED_LOCK(bucket_mutex);
+        std::unique_lock<InstrumentedMutex> lck(room_mutex);
+        bthread_usleep(2000);
+    }
+    ASSERT_TRUE(room_mutex.try_lock());
+    room_mutex.unlock();
+    FLAGS_room_lock_sample_1_in = saved_sample_1_in;
+    ASSERT_EQ(1, stats.bucket_wait.count());
+    ASSERT_EQ(1, stats.bucket_hold.count());
+    ASSERT_EQ(1, stats.room_wait.count());  // try_lock never waits
+    ASSERT_EQ(2, stats.room_hold.count());
+    ASSERT_GE(stats.bucket_hold.max_latency(), 2000);
+
+    bthread_usleep(1000000);
+    std::vector<LockedRoom> rooms;
+    stats.locked_rooms.GetLockedRooms(&rooms);
+    ASSERT_EQ(1u, rooms.size());
+    ASSERT_EQ("hot", rooms[0].room_id);
+    ASSERT_GE(rooms[0].lock_us_per_second, 2000.0);
+}
+
+TEST(TrafficCaptureTest, Write_and_Read) {
+    const std::string path = "sps_test.capture";
+    std::vector<RoomKey> rooms = { RoomKey("r1"), RoomKey("r2") };
+    {
+        TrafficCapture capture;
+        ASSERT_EQ(0, capture.Open(path, 1024 * 1024));
+        capture.OnSubscribe(UserKey(1, 2), rooms);
+        capture.OnNotifyRooms(rooms, 3, 100);
+        capture.OnNotifyUser(UserKey(1), true, 10);
+        capture.OnNotifyAll(-1, 1);
+        capture.OnRoomChange(UserKey(1, 2), std::vector<RoomKey>(1, RoomKey("r3")));
+        capture.OnUnsubscribe(UserKey(1, 2));
+    }
+
+    CaptureReader reader;
+    ASSERT_EQ(0, reader.Open(path));
+    CaptureRecord record;
+    ASSERT_TRUE(reader.Next(&record));
+    ASSERT_EQ(CaptureRecord::SUBSCRIBE, record.type());
+    ASSERT_EQ(1, record.user().uid());
+    ASSERT_EQ(2, record.user().terminal());
+    ASSERT_EQ(2, record.room_ids_size());
+    ASSERT_EQ("r2", record.room_ids(1));
+    ASSERT_TRUE(reader.Next(&record));
+    ASSERT_EQ(CaptureRecord::NOTIFY_ROOM, record.type());
+    ASSERT_EQ(3, record.terminal());
+    ASSERT_EQ(100, record.data_size());
+    ASSERT_TRUE(reader.Next(&record));
+    ASSERT_EQ(CaptureRecord::NOTIFY_USER, record.type());
+    ASSERT_TRUE(record.user().all_terminals());
+    ASSERT_TRUE(reader.Next(&record));
+    ASSERT_EQ(CaptureRecord::NOTIFY_ALL, record.type());
+    ASSERT_EQ(-1, record.terminal());
+    const int64_t offset_us = record.offset_us();
+    ASSERT_TRUE(reader.Next(&record));
+    ASSERT_EQ(CaptureRecord::ROOM_CHANGE, record.type());
+    ASSERT_EQ(2, record.user().terminal());
+    ASSERT_EQ(1, record.room_ids_size());
+    ASSERT_EQ("r3", record.room_ids(0));
+    ASSERT_TRUE(reader.Next(&record));
+    ASSERT_EQ(CaptureRecord::UNSUBSCRIBE, record.type());
+    ASSERT_LE(offset_us, record.offset_us());
+    ASSERT_FALSE(reader.Next(&record));
+    unlink(path.c_str());
+}
+
+class BucketQueueTest : public BucketTest {
+protected:
+    ServerOptions options() const override {
+        ServerOptions options;
+        options.use_execution_queue = true;
+        return options;
+    }
+};
+
+TEST_F(BucketQueueTest, Add_and_Del_Session) {
+    UserKey key1(__LINE__);
+    UserKey key2(__LINE__);
+    std::unique_ptr<Session> session1(new Session(key1, nullptr));
+    std::unique_ptr<Session> session2(new Session(key2, nullptr));
+    session1->set_interested_room("earth,mars");
+    session2->set_interested_room("mars");
+    bucket_->add_session(session1.release());
+    bucket_->add_session(session2.release());
+    ASSERT_EQ(2, bucket_->count_session());
+    ASSERT_EQ(2, bucket_->count_room());
+    ASSERT_EQ(2, bucket_->get_room(RoomKey("mars"))->size());
+
+    ASSERT_TRUE(bucket_->del_session(key1).get());
+    ASSERT_EQ(1, bucket_->count_session());
+    ASSERT_FALSE(bucket_->get_room(RoomKey("earth")));
+    ASSERT_TRUE(bucket_->get_room(RoomKey("mars"))->has_session(bucket_->get_session(key2)));
+}
+
+TEST_F(BucketQueueTest, Update_Session_Rooms) {
+    UserKey key(__LINE__);
+    std::unique_ptr<Session> session(new Session(key, nullptr));
+    session->set_interested_room("earth,mars");
+    bucket_->add_session(session.release());
+
+    bucket_->update_session_rooms(key, "mars,mercury");
+    ASSERT_FALSE(bucket_->get_room(RoomKey("earth")));
+    ASSERT_TRUE(bucket_->get_room(RoomKey("mars"))->has_session(bucket_->get_session(key)));
+    ASSERT_TRUE(bucket_->get_room(RoomKey("mercury"))->has_session(bucket_->get_session(key)));
+
+    butil::IOBuf data;
+    data.append("event");
+    bucket_->write_room(RoomKey("mars"), data);
+    std::vector<RoomKey> keys;
+    keys.push_back(RoomKey("mars"));
+    keys.push_back(RoomKey("mercury"));
+    ASSERT_EQ(1, bucket_->write_rooms(keys, data));
+}
+
 class BucketTestMultiThreaded : public testing::Test {
 protected:
     void SetUp() override {
-        bucket_ = new Bucket(0, ServerOptions());
+        bucket_ = new Bucket(0, options());
+        ops_ = 0;
         start_ = false;
         stop_ = false;
         bthread_cond_init(&start_barrier_, NULL);
@@ -217,6 +884,10 @@ protected:
         }
     }
 
+    virtual ServerOptions options() const {
+        return ServerOptions();
+    }
+
     void TearDown() override {
         stop_and_join();
         bthread_cond_destroy(&start_barrier_);
@@ -267,13 +938,38 @@ protected:
             }
             session->set_interested_room(oss.str());
             bucket_->add_session(session.release());
-            bthread_usleep(butil::RandInt(100, 1000));
+            pause();
             bucket_->del_session(key);
-            bthread_usleep(butil::RandInt(100, 1000));
+            pause();
+            ops_.fetch_add(2, std::memory_order_relaxed);
         }
     }
 
+    void pause() {
+        if (FLAGS_sps_test_simulation_pause_us > 0) {
+            bthread_usleep(butil::RandInt(FLAGS_sps_test_simulation_pause_us / 10,
+                                          FLAGS_sps_test_simulation_pause_us));
+        }
+    }
+
+    void simulate(const char* engine) {
+        start();
+        butil::Timer timer;
+        timer.start();
+        for (int i=0; i<FLAGS_sps_test_simulation_sec*5; ++i) {
+            bthread_usleep(200000);
+            LOG(INFO) << *bucket_;
+        }
+        stop_and_join();
+        timer.stop();
+        LOG(INFO) << *bucket_;
+        LOG(INFO) << "engine=" << engine
+                  << " ops=" << ops_.load()
+                  << " ops_per_sec=" << ops_.load() * 1000000 / std::max<int64_t>(timer.u_elapsed(), 1);
+    }
+
     Bucket* bucket_;
+    std::atomic<int64_t> ops_;
     bool start_;
     bthread_cond_t start_barrier_;
     bthread_mutex_t start_mutex_;
@@ -283,13 +979,20 @@ protected:
 };
 
 TEST_F(BucketTestMultiThreaded, Simulate_Session) {
-    start();
-    for (int i=0; i<FLAGS_sps_test_simulation_sec*5; ++i) {
-        bthread_usleep(200000);
-        LOG(INFO) << *bucket_;
+    simulate("mutex");
+}
+
+class BucketTestMultiThreadedQueue : public BucketTestMultiThreaded {
+protected:
+    ServerOptions options() const override {
+        ServerOptions options;
+        options.use_execution_queue = true;
+        return options;
     }
-    stop_and_join();
-    LOG(INFO) << *bucket_;
+};
+
+TEST_F(BucketTestMultiThreadedQueue, Simulate_Session) {
+    simulate("execution_queue");
 }
 
 int main(int argc, char **argv) {
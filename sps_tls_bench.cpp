@@ -0,0 +1,172 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+#include <gflags/gflags.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+#include <butil/endpoint.h>
+#include <bvar/bvar.h>
+#include <brpc/channel.h>
+
+
+DEFINE_string(server, "127.0.0.1:8080", "IP Address of sps");
+DEFINE_bool(resume, true, "Resume the TLS session of the previous handshake "
+            "of the same thread, instead of a full handshake every time");
+DEFINE_string(ciphers, "", "The cipher list offered, e.g. "
+              "ECDHE-ECDSA-AES128-GCM-SHA256 to measure an ECDSA certificate");
+DEFINE_bool(tls13, false, "Offer TLS 1.3, whose session tickets arrive after "
+            "the handshake and are never read here, so nothing resumes");
+DEFINE_int32(thread_num, 8, "Number of clients handshaking");
+DEFINE_int32(duration_s, 10, "Seconds the benchmark lasts");
+DEFINE_int32(timeout_ms, 1000, "Timeout of reading the cpu usage of sps");
+
+bvar::LatencyRecorder g_handshake_latency("sps_tls_bench_handshake");
+bvar::Adder<int64_t> g_full_count("sps_tls_bench_full");
+bvar::Adder<int64_t> g_resumed_count("sps_tls_bench_resumed");
+bvar::Adder<int64_t> g_error_count("sps_tls_bench_error");
+
+static volatile bool g_stop = false;
+static SSL_CTX* g_ctx = NULL;
+static butil::EndPoint g_server;
+
+// Handshakes with sps over and over, one connection at a time.
+static void* handshaker(void*) {
+    SSL_SESSION* session = NULL;
+    while (!g_stop) {
+        int fd = butil::tcp_connect(g_server, NULL);
+        if (fd < 0) {
+            g_error_count << 1;
+            LOG_EVERY_SECOND(WARNING) << "Fail to connect " << g_server << ": " << berror();
+            usleep(50000);
+            continue;
+        }
+        SSL* ssl = SSL_new(g_ctx);
+        SSL_set_fd(ssl, fd);
+        if (session) {
+            SSL_set_session(ssl, session);
+        }
+        int64_t start_us = butil::cpuwide_time_us();
+        if (SSL_connect(ssl) != 1) {
+            g_error_count << 1;
+            LOG_EVERY_SECOND(WARNING) << "Fail to handshake: "
+                                      << ERR_error_string(ERR_get_error(), NULL);
+            ERR_clear_error();
+        } else {
+            g_handshake_latency << butil::cpuwide_time_us() - start_us;
+            if (SSL_session_reused(ssl)) {
+                g_resumed_count << 1;
+            } else {
+                g_full_count << 1;
+            }
+            if (FLAGS_resume) {
+                if (session) {
+                    SSL_SESSION_free(session);
+                }
+                session = SSL_get1_session(ssl);
+            }
+            SSL_shutdown(ssl);
+        }
+        SSL_free(ssl);
+        close(fd);
+    }
+    if (session) {
+        SSL_SESSION_free(session);
+    }
+    return NULL;
+}
+
+// The cores busy in sps, read from its builtin /vars. Negative on failure.
+static double server_cpu_usage(brpc::Channel& channel) {
+    brpc::Controller cntl;
+    cntl.http_request().uri() = "/vars/process_cpu_usage";
+    channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    if (cntl.Failed()) {
+        LOG_EVERY_SECOND(WARNING) << "Fail to read cpu usage: " << cntl.ErrorText();
+        return -1;
+    }
+    // "process_cpu_usage : 1.234"
+    std::string body = cntl.response_attachment().to_string();
+    size_t pos = body.find(':');
+    return pos == std::string::npos ? -1 : strtod(body.c_str() + pos + 1, NULL);
+}
+
+int main(int argc, char* argv[]) {
+    GFLAGS_NS::SetUsageMessage("Measure the TLS handshakes per second per core of sps");
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    if (butil::str2endpoint(FLAGS_server.c_str(), &g_server) != 0) {
+        LOG(ERROR) << "Invalid server: " << FLAGS_server;
+        return -1;
+    }
+
+    SSL_library_init();
+    SSL_load_error_strings();
+    g_ctx = SSL_CTX_new(SSLv23_client_method());
+    if (g_ctx == NULL) {
+        LOG(ERROR) << "Fail to create SSL_CTX";
+        return -1;
+    }
+#ifdef SSL_OP_NO_TLSv1_3
+    if (!FLAGS_tls13) {
+        SSL_CTX_set_options(g_ctx, SSL_OP_NO_TLSv1_3);
+    }
+#endif
+    if (!FLAGS_ciphers.empty()
+            && SSL_CTX_set_cipher_list(g_ctx, FLAGS_ciphers.c_str()) != 1) {
+        LOG(ERROR) << "Invalid ciphers: " << FLAGS_ciphers;
+        return -1;
+    }
+
+    // sps takes plain HTTP on its TLS port as well.
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.timeout_ms = FLAGS_timeout_ms;
+    options.protocol = brpc::PROTOCOL_HTTP;
+    if (channel.Init(FLAGS_server.c_str(), &options) != 0) {
+        LOG(ERROR) << "Fail to initialize http channel";
+        return -1;
+    }
+
+    std::vector<pthread_t> tids(FLAGS_thread_num);
+    for (int i = 0; i < FLAGS_thread_num; ++i) {
+        if (pthread_create(&tids[i], NULL, handshaker, NULL) != 0) {
+            LOG(ERROR) << "Fail to create pthread";
+            return -1;
+        }
+    }
+
+    double cpu_sum = 0;
+    int cpu_samples = 0;
+    for (int i = 0; i < FLAGS_duration_s; ++i) {
+        sleep(1);
+        const double cpu = server_cpu_usage(channel);
+        const int64_t qps = g_handshake_latency.qps(1);
+        if (cpu > 0) {
+            cpu_sum += cpu;
+            ++cpu_samples;
+        }
+        LOG(INFO) << "resume=" << FLAGS_resume
+                  << " handshake_qps=" << qps
+                  << " per_core=" << (cpu > 0 ? qps / cpu : 0)
+                  << " latency=" << g_handshake_latency.latency(1)
+                  << " full=" << g_full_count.get_value()
+                  << " resumed=" << g_resumed_count.get_value()
+                  << " error=" << g_error_count.get_value();
+    }
+    g_stop = true;
+    for (int i = 0; i < FLAGS_thread_num; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    const double average_qps = (double)g_handshake_latency.count() / std::max(FLAGS_duration_s, 1);
+    LOG(INFO) << "resume=" << FLAGS_resume
+              << " average_qps=" << average_qps
+              << " per_core=" << (cpu_samples ? average_qps / (cpu_sum / cpu_samples) : 0)
+              << " p99_latency=" << g_handshake_latency.latency_percentile(0.99)
+              << " full=" << g_full_count.get_value()
+              << " resumed=" << g_resumed_count.get_value();
+    SSL_CTX_free(g_ctx);
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include "sps_trace.h"
+
+#include <inttypes.h>
+#include <butil/time.h>
+#include <bvar/bvar.h>
+#include <brpc/traceprintf.h>
+
+
+namespace sps {
+
+static bvar::LatencyRecorder g_bucket_wait("sps_publish_bucket_wait");
+static bvar::LatencyRecorder g_room_wait("sps_publish_room_wait");
+static bvar::LatencyRecorder g_first_write("sps_publish_first_write");
+static bvar::LatencyRecorder g_last_write("sps_publish_last_write");
+
+PublishTrace::PublishTrace()
+    : accept_us_(butil::cpuwide_time_us())
+    , bucket_wait_us_(0)
+    , room_wait_us_(0)
+    , first_write_us_(INT64_MAX)
+    , last_write_us_(0) {
+}
+
+PublishTrace::~PublishTrace() {
+    g_bucket_wait << bucket_wait_us_.load(std::memory_order_relaxed);
+    g_room_wait << room_wait_us_.load(std::memory_order_relaxed);
+    const int64_t last_us = last_write_us_.load(std::memory_order_relaxed);
+    if (last_us == 0) {
+        return;  // no one to write
+    }
+    g_first_write << first_write_us_.load(std::memory_order_relaxed) - accept_us_;
+    g_last_write << last_us - accept_us_;
+}
+
+void PublishTrace::AddWrites(int64_t first_us, int64_t last_us) {
+    int64_t v = first_write_us_.load(std::memory_order_relaxed);
+    while (first_us < v &&
+           !first_write_us_.compare_exchange_weak(v, first_us, std::memory_order_relaxed)) {
+    }
+    v = last_write_us_.load(std::memory_order_relaxed);
+    while (last_us > v &&
+           !last_write_us_.compare_exchange_weak(v, last_us, std::memory_order_relaxed)) {
+    }
+}
+
+void PublishTrace::Annotate() const {
+    const int64_t bucket_wait_us = bucket_wait_us_.load(std::memory_order_relaxed);
+    const int64_t room_wait_us = room_wait_us_.load(std::memory_order_relaxed);
+    const int64_t first_us = first_write_us_.load(std::memory_order_relaxed);
+    const int64_t last_us = last_write_us_.load(std::memory_order_relaxed);
+    if (last_us == 0) {
+        TRACEPRINTF("bucket_wait=%" PRId64 "us room_wait=%" PRId64 "us written=none",
+                    bucket_wait_us, room_wait_us);
+        return;
+    }
+    TRACEPRINTF("bucket_wait=%" PRId64 "us room_wait=%" PRId64 "us first_write=%" PRId64
+                "us last_write=%" PRId64 "us", bucket_wait_us, room_wait_us,
+                first_us - accept_us_, last_us - accept_us_);
+}
+
+}  // namespace sps
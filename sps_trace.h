@@ -0,0 +1,52 @@
+#ifndef SPS_TRACE_H_
+#define SPS_TRACE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+
+namespace sps {
+
+// The stages of a published event, from its accept by the handler to the
+// last socket write of its fan-out. A trace is shared by the buckets
+// writing the event, and the latencies are recorded when the last of them
+// releases it:
+//   sps_publish_bucket_wait   bucket lock, or bucket queue, waits on the way
+//   sps_publish_room_wait     room lock waits on the way
+//   sps_publish_first_write   accept to the first session written
+//   sps_publish_last_write    accept to the last session written
+class PublishTrace {
+public:
+    typedef std::shared_ptr<PublishTrace> Ptr;
+
+    // Stamps the accept of an event.
+    static Ptr Create() { return Ptr(new PublishTrace); }
+    ~PublishTrace();
+
+    void AddBucketWait(int64_t wait_us) {
+        bucket_wait_us_.fetch_add(wait_us, std::memory_order_relaxed);
+    }
+    void AddRoomWait(int64_t wait_us) {
+        room_wait_us_.fetch_add(wait_us, std::memory_order_relaxed);
+    }
+    // Called once by each writer of a part of the fan-out, with the times
+    // its first and last sessions were written.
+    void AddWrites(int64_t first_us, int64_t last_us);
+
+    // Annotates the rpcz span of the calling bthread, if it is sampled.
+    void Annotate() const;
+
+private:
+    PublishTrace();
+
+    const int64_t accept_us_;
+    std::atomic<int64_t> bucket_wait_us_;
+    std::atomic<int64_t> room_wait_us_;
+    std::atomic<int64_t> first_write_us_;
+    std::atomic<int64_t> last_write_us_;
+};
+
+}  // namespace sps
+
+#endif  // SPS_TRACE_H_